@@ -0,0 +1,267 @@
+#include "pch.h"
+#include "Clusters.h"
+#include "Parallel.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Checks the light assignment of Clusters.cpp against brute force, without a window or GPU
+// Usage: clustertest
+// Prints one JSON object per case and returns 1 if any case failed
+//
+// Random points in the view frustum are put into their cluster the way the shader does it, and every light
+// whose sphere contains a point has to be in that cluster's list, unless the cluster is full. The overflow
+// and truncation counters are checked against cases where the expected numbers are known.
+
+namespace {
+	const float nearPlane = 0.1f;
+	const float farPlane = 100.0f;
+
+	double now() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	float random(float min, float max) {
+		return min + (max - min) * rand() / (float)RAND_MAX;
+	}
+
+	// A camera at eye, turned by yaw around the y axis, with column major view and projection matrices
+	// Right handed cameras look down -z in view space like OpenGL, left handed ones down +z
+	struct Camera {
+		float eye[3];
+		float yaw;
+		float view[16];
+		float projection[16];
+		// Sign of the view space z of points in front of the camera
+		float forward;
+	};
+
+	Camera createCamera(float x, float y, float z, float yaw, bool rightHanded, float offCenterX) {
+		Camera camera;
+		camera.eye[0] = x;
+		camera.eye[1] = y;
+		camera.eye[2] = z;
+		camera.yaw = yaw;
+		camera.forward = rightHanded ? -1.0f : 1.0f;
+
+		// view = R * translate(-eye), R rotates world into view space
+		float c = cosf(yaw);
+		float s = sinf(yaw);
+		float rotation[9] = { c, 0.0f, s, 0.0f, 1.0f, 0.0f, -s, 0.0f, c }; // column major 3x3
+		memset(camera.view, 0, sizeof(camera.view));
+		for (int column = 0; column < 3; ++column) {
+			for (int row = 0; row < 3; ++row) {
+				camera.view[column * 4 + row] = rotation[column * 3 + row];
+			}
+		}
+		for (int row = 0; row < 3; ++row) {
+			camera.view[12 + row] = -(rotation[row] * x + rotation[3 + row] * y + rotation[6 + row] * z);
+		}
+		camera.view[15] = 1.0f;
+
+		float fov = 1.2f;
+		float aspect = 16.0f / 9.0f;
+		float t = 1.0f / tanf(fov / 2.0f);
+		memset(camera.projection, 0, sizeof(camera.projection));
+		camera.projection[0] = t / aspect;
+		camera.projection[5] = t;
+		camera.projection[8] = offCenterX;
+		camera.projection[10] = camera.forward * (farPlane + nearPlane) / (farPlane - nearPlane);
+		camera.projection[11] = camera.forward;
+		camera.projection[14] = -2.0f * farPlane * nearPlane / (farPlane - nearPlane);
+		return camera;
+	}
+
+	// View space to world space, the inverse of camera.view
+	void toWorld(const Camera& camera, const float* view, float* world) {
+		for (int i = 0; i < 3; ++i) {
+			world[i] = camera.view[i * 4 + 0] * view[0] + camera.view[i * 4 + 1] * view[1] + camera.view[i * 4 + 2] * view[2] + camera.eye[i];
+		}
+	}
+
+	// A random point in the frustum up to maxDepth, in view space, with its normalized device coordinates
+	void randomPoint(const Camera& camera, float maxDepth, float* view, float* ndc) {
+		const float* p = camera.projection;
+		float depth = random(nearPlane, maxDepth);
+		ndc[0] = random(-1.0f, 1.0f);
+		ndc[1] = random(-1.0f, 1.0f);
+		view[2] = camera.forward * depth;
+		// ndc = (p[0] * x + p[8] * z) / w with w = p[11] * z = depth
+		view[0] = (ndc[0] * depth - p[8] * view[2]) / p[0];
+		view[1] = (ndc[1] * depth - p[9] * view[2]) / p[5];
+	}
+
+	// Cluster of a view space point, computed like the fragment shader does
+	int clusterOf(const float* view, const float* ndc, float forward) {
+		float depth = forward * view[2];
+		int x = (int)((ndc[0] * 0.5f + 0.5f) * clusterGridX);
+		int y = (int)((ndc[1] * 0.5f + 0.5f) * clusterGridY);
+		int z = (int)(logf(depth / nearPlane) / logf(farPlane / nearPlane) * clusterGridZ);
+		if (x >= clusterGridX) x = clusterGridX - 1;
+		if (y >= clusterGridY) y = clusterGridY - 1;
+		if (z >= clusterGridZ) z = clusterGridZ - 1;
+		return x + y * clusterGridX + z * clusterGridX * clusterGridY;
+	}
+
+	bool contains(const ClusterGrid* grid, int cluster, int light) {
+		const int* indices = &grid->lightIndices[grid->offsets[cluster]];
+		for (int i = 0; i < grid->counts[cluster]; ++i) {
+			if (indices[i] == light) return true;
+		}
+		return false;
+	}
+
+	struct Result {
+		int samples;
+		// Light and point pairs that had to be in the list, and how many were not
+		int checked;
+		int missing;
+		// Points in full clusters, where lights may be missing
+		int full;
+		// Lists with indices out of range or twice the same light
+		int broken;
+	};
+
+	Result check(const ClusterGrid* grid, const Lights* lights, const Camera& camera, float maxDepth, int samples) {
+		Result result;
+		memset(&result, 0, sizeof(result));
+		result.samples = samples;
+
+		for (int cluster = 0; cluster < numClusters; ++cluster) {
+			const int* indices = &grid->lightIndices[grid->offsets[cluster]];
+			bool broken = grid->counts[cluster] > maxLightsPerCluster;
+			for (int i = 0; i < grid->counts[cluster] && !broken; ++i) {
+				broken = indices[i] < 0 || indices[i] >= lights->count;
+				for (int j = 0; j < i && !broken; ++j) {
+					broken = indices[i] == indices[j];
+				}
+			}
+			if (broken) ++result.broken;
+		}
+
+		for (int sample = 0; sample < samples; ++sample) {
+			float view[3], ndc[2], world[3];
+			randomPoint(camera, maxDepth, view, ndc);
+			toWorld(camera, view, world);
+			int cluster = clusterOf(view, ndc, camera.forward);
+			if (grid->counts[cluster] == maxLightsPerCluster) {
+				++result.full;
+				continue;
+			}
+
+			for (int l = 0; l < lights->count; ++l) {
+				float dx = lights->positions[l * 3 + 0] - world[0];
+				float dy = lights->positions[l * 3 + 1] - world[1];
+				float dz = lights->positions[l * 3 + 2] - world[2];
+				// Points right on the sphere are left out, the cluster bounds are only float exact
+				float radius = lights->radii[l] * 0.999f;
+				if (dx * dx + dy * dy + dz * dz >= radius * radius) continue;
+				++result.checked;
+				if (!contains(grid, cluster, l)) ++result.missing;
+			}
+		}
+		return result;
+	}
+
+	// Lights with random radii spread through the frustum up to maxDepth
+	Lights* randomLights(const Camera& camera, int count, float maxDepth, float minRadius, float maxRadius) {
+		Lights* lights = createLights(count);
+		for (int i = 0; i < count; ++i) {
+			float view[3], ndc[2], world[3];
+			randomPoint(camera, maxDepth, view, ndc);
+			toWorld(camera, view, world);
+			float radius = random(minRadius, maxRadius);
+			addLight(lights, world[0], world[1], world[2], 1.0f, 1.0f, 1.0f, radius, 1.0f, radius);
+		}
+		return lights;
+	}
+
+	// Cuts the indices down to what fits into the light index texture and checks the lists still fit into it
+	// Clusters past the end keep their offset with no lights
+	bool truncate(ClusterGrid* grid, int expectedTruncated) {
+		int before = grid->numLightIndices;
+		truncateLightIndices(grid, maxLightIndices);
+		int total = 0;
+		bool inside = true;
+		for (int cluster = 0; cluster < numClusters; ++cluster) {
+			total += grid->counts[cluster];
+			inside = inside && (grid->counts[cluster] == 0 || grid->offsets[cluster] + grid->counts[cluster] <= maxLightIndices);
+		}
+		return inside && grid->truncated == expectedTruncated && total == grid->numLightIndices
+			&& grid->numLightIndices == (before < maxLightIndices ? before : maxLightIndices);
+	}
+
+	bool failed = false;
+
+	// expectedOverflow and expectedTruncated are -1 if they are not known in advance, -2 if they only have to be above 0
+	void run(const char* name, const Camera& camera, Lights* lights, float maxDepth, int expectedOverflow, int expectedTruncated) {
+		ClusterGrid* grid = createClusterGrid(nearPlane, farPlane);
+		double start = now();
+		assignLights(grid, lights, camera.view, camera.projection);
+		double time = now() - start;
+
+		// The parallel result has to match the serial one exactly
+		ClusterGrid* serial = createClusterGrid(nearPlane, farPlane);
+		assignLights(serial, lights, camera.view, camera.projection, false);
+		bool same = serial->numLightIndices == grid->numLightIndices && serial->overflow == grid->overflow
+			&& memcmp(serial->counts, grid->counts, numClusters * sizeof(int)) == 0
+			&& memcmp(serial->lightIndices, grid->lightIndices, grid->numLightIndices * sizeof(int)) == 0;
+		deleteClusterGrid(serial);
+
+		Result result = check(grid, lights, camera, maxDepth, 100000);
+		int assignments = grid->numLightIndices;
+		bool overflowed = false;
+		for (int cluster = 0; cluster < numClusters && !overflowed; ++cluster) {
+			overflowed = grid->counts[cluster] == maxLightsPerCluster;
+		}
+		bool overflow = expectedOverflow == -2 ? grid->overflow > 0 && overflowed
+			: expectedOverflow >= 0 ? grid->overflow == expectedOverflow : (grid->overflow == 0 || overflowed);
+		bool truncation = truncate(grid, expectedTruncated >= 0 ? expectedTruncated : assignments > maxLightIndices ? assignments - maxLightIndices : 0);
+
+		// Points in full clusters are not checked, a case where all clusters are full only checks the counters
+		bool sampled = result.checked > 0 || result.full == result.samples;
+		bool passed = same && overflow && truncation && sampled && result.missing == 0 && result.broken == 0;
+		failed = failed || !passed;
+
+		printf("{\"test\":\"clusters\",\"name\":\"%s\",\"lights\":%i,\"samples\":%i,\"checked\":%i,\"missing\":%i,\"in_full_clusters\":%i",
+			name, lights->count, result.samples, result.checked, result.missing, result.full);
+		printf(",\"broken_lists\":%i,\"serial_matches\":%s,\"assignments\":%i,\"overflow\":%i,\"truncated\":%i,\"assign_ms\":%.3f,\"passed\":%s}\n",
+			result.broken, same ? "true" : "false", assignments, grid->overflow, grid->truncated, time * 1000.0, passed ? "true" : "false");
+
+		deleteClusterGrid(grid);
+		deleteLights(lights);
+	}
+}
+
+int main() {
+	// More workers than this machine may have, so the parallel path is always covered
+	startWorkers(3);
+	srand(1);
+
+	Camera camera = createCamera(3.0f, 1.0f, -2.0f, 0.7f, true, 0.0f);
+	run("sparse", camera, randomLights(camera, 500, 60.0f, 0.5f, 5.0f), 40.0f, 0, 0);
+
+	Camera leftHanded = createCamera(-5.0f, 0.0f, 8.0f, -1.9f, false, 0.0f);
+	run("sparse left handed", leftHanded, randomLights(leftHanded, 500, 60.0f, 0.5f, 5.0f), 40.0f, 0, 0);
+
+	Camera offCenter = createCamera(0.0f, 2.0f, 0.0f, 3.0f, true, 0.3f);
+	run("sparse off center", offCenter, randomLights(offCenter, 500, 60.0f, 0.5f, 5.0f), 40.0f, 0, 0);
+
+	// Many lights close to the camera fill some clusters, more light indices than the texture holds
+	run("crowded", camera, randomLights(camera, 1000, 8.0f, 2.0f, 6.0f), 8.0f, -2, -1);
+
+	// Every light covers the whole frustum, so every cluster is full and the texture overflows by a known amount
+	const int numHuge = 200;
+	Lights* huge = createLights(numHuge);
+	for (int i = 0; i < numHuge; ++i) {
+		addLight(huge, camera.eye[0] + random(-1.0f, 1.0f), camera.eye[1] + random(-1.0f, 1.0f), camera.eye[2] + random(-1.0f, 1.0f),
+			1.0f, 1.0f, 1.0f, 1000.0f, 1.0f, 1000.0f);
+	}
+	run("every cluster full", camera, huge, 40.0f, numClusters * (numHuge - maxLightsPerCluster), numClusters * maxLightsPerCluster - maxLightIndices);
+
+	stopWorkers();
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdio>
+
+namespace Kore {
+	// Stand-in for Kore's FileReader, reads the whole file with stdio
+	class FileReader {
+	public:
+		enum FileType {
+			Asset,
+			Save
+		};
+
+		FileReader() : data(nullptr), length(0) {}
+
+		FileReader(const char* filename, FileType type = Asset) : data(nullptr), length(0) {
+			open(filename, type);
+		}
+
+		~FileReader() {
+			delete[] data;
+		}
+
+		bool open(const char* filename, FileType type = Asset) {
+			FILE* file = fopen(filename, "rb");
+			if (file == nullptr) return false;
+			fseek(file, 0, SEEK_END);
+			length = (int)ftell(file);
+			fseek(file, 0, SEEK_SET);
+			data = new char[length > 0 ? length : 1];
+			length = (int)fread(data, 1, length, file);
+			fclose(file);
+			return true;
+		}
+
+		void* readAll() {
+			return data;
+		}
+
+		int size() const {
+			return length;
+		}
+
+	private:
+		char* data;
+		int length;
+	};
+}
@@ -0,0 +1,241 @@
+#include "pch.h"
+#include "ObjLoader.h"
+#include "MeshVertices.h"
+#include "Memory.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Benchmarks the obj loader, the vertex and tangent build and the memory allocator
+// Usage: loaderbench [--repeat <n>] [--max-triangles <n>] [obj files]
+// Prints one JSON object per line. Every case runs in a process of its own, so peak_rss_kb is the
+// peak of that case alone, including the input text
+
+namespace {
+	int repeat = 3;
+	int maxTriangles = 10000000;
+
+	double now() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	long peakRSS() {
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_maxrss;
+	}
+
+	// A growing text buffer
+	struct Text {
+		char* data;
+		int length;
+		int capacity;
+	};
+
+	void append(Text& text, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+	void append(Text& text, const char* format, ...) {
+		char line[256];
+		va_list arguments;
+		va_start(arguments, format);
+		int length = vsnprintf(line, sizeof(line), format, arguments);
+		va_end(arguments);
+		if (text.length + length > text.capacity) {
+			int capacity = text.capacity * 2 > text.length + length ? text.capacity * 2 : text.length + length;
+			char* bigger = new char[capacity];
+			memcpy(bigger, text.data, text.length);
+			delete[] text.data;
+			text.data = bigger;
+			text.capacity = capacity;
+		}
+		memcpy(text.data + text.length, line, length);
+		text.length += length;
+	}
+
+	bool readFile(const char* filename, Text& text) {
+		FILE* file = fopen(filename, "rb");
+		if (file == nullptr) return false;
+		fseek(file, 0, SEEK_END);
+		text.capacity = (int)ftell(file);
+		fseek(file, 0, SEEK_SET);
+		text.data = new char[text.capacity > 0 ? text.capacity : 1];
+		text.length = (int)fread(text.data, 1, text.capacity, file);
+		fclose(file);
+		return true;
+	}
+
+	// A flat grid of about the given number of triangles, with a texture coordinate per vertex and one normal
+	void generateGrid(int triangles, Text& text) {
+		int quads = triangles / 2 > 1 ? triangles / 2 : 1;
+		int width = 1;
+		while (width * width < quads) ++width;
+		int height = (quads + width - 1) / width;
+
+		text.data = nullptr;
+		text.length = 0;
+		text.capacity = 0;
+		append(text, "# %i x %i grid\n", width, height);
+		for (int y = 0; y <= height; ++y) {
+			for (int x = 0; x <= width; ++x) {
+				append(text, "v %g %g 0\n", (float)x / width, (float)y / height);
+			}
+		}
+		for (int y = 0; y <= height; ++y) {
+			for (int x = 0; x <= width; ++x) {
+				append(text, "vt %g %g\n", (float)x / width, (float)y / height);
+			}
+		}
+		append(text, "vn 0 0 1\n");
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				int a = y * (width + 1) + x + 1;
+				int b = a + 1;
+				int c = a + width + 1;
+				int d = c + 1;
+				append(text, "f %i/%i/1 %i/%i/1 %i/%i/1\n", a, a, b, b, d, d);
+				append(text, "f %i/%i/1 %i/%i/1 %i/%i/1\n", a, a, d, d, c, c);
+			}
+		}
+	}
+
+	// Prints s as a JSON string
+	void printString(const char* s) {
+		putchar('"');
+		for (; *s != 0; ++s) {
+			if (*s == '"' || *s == '\\') putchar('\\');
+			putchar(*s);
+		}
+		putchar('"');
+	}
+
+	void benchmarkObj(const char* name, const Text& text) {
+		// Best of all repetitions
+		double parseTime = 0.0;
+		Mesh* mesh = nullptr;
+		for (int i = 0; i < repeat; ++i) {
+			if (mesh != nullptr) deleteMesh(mesh);
+			double start = now();
+			mesh = parseObj(text.data, text.length);
+			double time = now() - start;
+			if (i == 0 || time < parseTime) parseTime = time;
+		}
+
+		float* vertices = new float[mesh->numVertices * meshVertexStride];
+		double buildTime = 0.0;
+		for (int i = 0; i < repeat; ++i) {
+			double start = now();
+			buildVertices(mesh, 1.0f, vertices);
+			buildTangents(vertices, mesh->indices, mesh->numIndices);
+			double time = now() - start;
+			if (i == 0 || time < buildTime) buildTime = time;
+		}
+
+		printf("{\"benchmark\":\"obj\",\"name\":");
+		printString(name);
+		printf(",\"bytes\":%i,\"vertices\":%i,\"triangles\":%i,\"repeat\":%i", text.length, mesh->numVertices, mesh->numFaces, repeat);
+		printf(",\"parse_seconds\":%.6f,\"parse_mb_per_s\":%.3f,\"parse_vertices_per_s\":%.0f",
+			parseTime, text.length / parseTime / 1000000.0, mesh->numVertices / parseTime);
+		printf(",\"build_seconds\":%.6f,\"build_vertices_per_s\":%.0f", buildTime, mesh->numVertices / buildTime);
+		printf(",\"peak_rss_kb\":%li}\n", peakRSS());
+
+		delete[] vertices;
+		deleteMesh(mesh);
+	}
+
+	void benchmarkMemory() {
+		const int size = 16;
+		const int count = 100000;
+
+		Memory::init();
+		double start = now();
+		for (int i = 0; i < count; ++i) {
+			static_cast<volatile u8*>(Memory::allocate(size))[0] = 0;
+		}
+		double memoryTime = now() - start;
+
+		u8** blocks = new u8*[count];
+		start = now();
+		for (int i = 0; i < count; ++i) {
+			blocks[i] = new u8[size];
+			static_cast<volatile u8*>(blocks[i])[0] = 0;
+		}
+		double newTime = now() - start;
+		for (int i = 0; i < count; ++i) {
+			delete[] blocks[i];
+		}
+		delete[] blocks;
+
+		printf("{\"benchmark\":\"memory\",\"name\":\"allocate %i bytes\",\"allocations\":%i", size, count);
+		printf(",\"allocate_per_s\":%.0f,\"new_per_s\":%.0f,\"peak_rss_kb\":%li}\n", count / memoryTime, count / newTime, peakRSS());
+	}
+
+	// Runs a case in a child process, a crash is reported instead of ending the whole run
+	template<class Function> void run(const char* benchmark, const char* name, Function function) {
+		fflush(stdout);
+		pid_t child = fork();
+		if (child == 0) {
+			function();
+			fflush(stdout);
+			_exit(0);
+		}
+		int status = 0;
+		if (child < 0 || waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			printf("{\"benchmark\":\"%s\",\"name\":", benchmark);
+			printString(name);
+			printf(",\"error\":\"%s %i\"}\n", WIFSIGNALED(status) ? "signal" : "status", WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	int firstFile = 1;
+	while (firstFile + 1 < argc && argv[firstFile][0] == '-') {
+		if (strcmp(argv[firstFile], "--repeat") == 0) {
+			repeat = atoi(argv[firstFile + 1]);
+		}
+		else if (strcmp(argv[firstFile], "--max-triangles") == 0) {
+			maxTriangles = atoi(argv[firstFile + 1]);
+		}
+		else {
+			fprintf(stderr, "Usage: %s [--repeat <n>] [--max-triangles <n>] [obj files]\n", argv[0]);
+			return 1;
+		}
+		firstFile += 2;
+	}
+	if (repeat < 1) repeat = 1;
+
+	for (int i = firstFile; i < argc; ++i) {
+		const char* filename = argv[i];
+		run("obj", filename, [=]() {
+			Text text;
+			if (!readFile(filename, text)) {
+				fprintf(stderr, "Could not read %s\n", filename);
+				_exit(1);
+			}
+			benchmarkObj(filename, text);
+			delete[] text.data;
+		});
+	}
+
+	for (int triangles = 1000; triangles <= maxTriangles; triangles *= 10) {
+		char name[64];
+		snprintf(name, sizeof(name), "grid %i", triangles);
+		run("obj", name, [=]() {
+			Text text;
+			generateGrid(triangles, text);
+			benchmarkObj(name, text);
+			delete[] text.data;
+		});
+	}
+
+	run("memory", "allocate", benchmarkMemory);
+
+	return 0;
+}
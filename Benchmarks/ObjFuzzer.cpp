@@ -0,0 +1,31 @@
+#include "pch.h"
+#include "ObjLoader.h"
+#include "MeshVertices.h"
+
+#include <cstdlib>
+
+// libFuzzer entry point for the obj loader, see the Makefile
+// Besides crashes and sanitizer reports, every index of the parsed mesh has to refer to a parsed vertex
+
+namespace {
+	// Large inputs only slow the fuzzer down
+	const size_t maxInputSize = 64 * 1024;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const u8* data, size_t size) {
+	if (size > maxInputSize) return 0;
+
+	Mesh* mesh = parseObj(reinterpret_cast<const char*>(data), (int)size);
+	if (mesh->numIndices != mesh->numFaces * 3) abort();
+	for (int i = 0; i < mesh->numIndices; ++i) {
+		if (mesh->indices[i] < 0 || mesh->indices[i] >= mesh->numVertices) abort();
+	}
+
+	float* vertices = new float[mesh->numVertices * meshVertexStride];
+	buildVertices(mesh, 1.0f, vertices);
+	buildTangents(vertices, mesh->indices, mesh->numIndices);
+	delete[] vertices;
+
+	deleteMesh(mesh);
+	return 0;
+}
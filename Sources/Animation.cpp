@@ -0,0 +1,149 @@
+#include "pch.h"
+#include "Animation.h"
+#include "Arrays.h"
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ANIMATION_SSE
+#include <emmintrin.h>
+#endif
+
+namespace {
+	const float pi = 3.14159265358979f;
+
+	void reserve(Animations* animations, int capacity) {
+		if (capacity <= animations->capacity) return;
+		grow(animations->objects, animations->count, capacity);
+		grow(animations->clips, animations->count, capacity);
+		grow(animations->phases, animations->count, capacity);
+		animations->capacity = capacity;
+	}
+
+#ifdef ANIMATION_SSE
+	// Polynomial sine, accurate to about 4e-6 for angles of a few turns
+	__m128 sin4(__m128 x) {
+		const __m128 signMask = _mm_set1_ps(-0.0f);
+		const __m128 piVector = _mm_set1_ps(pi);
+
+		// Reduce to [-pi, pi]
+		__m128 turns = _mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(0.5f / pi))));
+		x = _mm_sub_ps(x, _mm_mul_ps(turns, _mm_set1_ps(2.0f * pi)));
+
+		// Fold to [-pi/2, pi/2] using sin(x) = sin(pi - x)
+		__m128 signedPi = _mm_or_ps(piVector, _mm_and_ps(x, signMask));
+		__m128 outside = _mm_cmpgt_ps(_mm_andnot_ps(signMask, x), _mm_set1_ps(0.5f * pi));
+		x = _mm_or_ps(_mm_and_ps(outside, _mm_sub_ps(signedPi, x)), _mm_andnot_ps(outside, x));
+
+		__m128 x2 = _mm_mul_ps(x, x);
+		__m128 p = _mm_set1_ps(1.0f / 362880.0f);
+		p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(-1.0f / 5040.0f));
+		p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(1.0f / 120.0f));
+		p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(-1.0f / 6.0f));
+		p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(1.0f));
+		return _mm_mul_ps(p, x);
+	}
+#endif
+
+	// Angle of the deformed vertex, see pacman.vert.glsl
+	inline float deformedAngle(float angle, float side, float morph) {
+		float a = angle * morph;
+		return a + side * 2.0f * (pi - a);
+	}
+}
+
+ChompPose* createChompPose(const float* vertices, int numVertices, int stride) {
+	ChompPose* pose = new ChompPose;
+	pose->numVertices = numVertices;
+	pose->lengths = new float[numVertices];
+	pose->angles = new float[numVertices];
+	pose->sides = new float[numVertices];
+	pose->depths = new float[numVertices];
+	for (int i = 0; i < numVertices; ++i) {
+		const float* v = &vertices[i * stride];
+		float length = sqrtf(v[0] * v[0] + v[1] * v[1]);
+		float cosine = length > 0.0f ? v[0] / length : 1.0f;
+		if (cosine > 1.0f) cosine = 1.0f;
+		if (cosine < -1.0f) cosine = -1.0f;
+		pose->lengths[i] = length;
+		pose->angles[i] = acosf(cosine);
+		// sign(y) * 0.5 + 0.5
+		pose->sides[i] = v[1] > 0.0f ? 1.0f : (v[1] < 0.0f ? 0.0f : 0.5f);
+		pose->depths[i] = v[2];
+	}
+	return pose;
+}
+
+void deleteChompPose(ChompPose* pose) {
+	delete[] pose->lengths;
+	delete[] pose->angles;
+	delete[] pose->sides;
+	delete[] pose->depths;
+	delete pose;
+}
+
+Animations* createAnimations(int capacity) {
+	Animations* animations = new Animations;
+	memset(animations, 0, sizeof(Animations));
+	reserve(animations, capacity > 0 ? capacity : 1);
+	return animations;
+}
+
+void deleteAnimations(Animations* animations) {
+	delete[] animations->objects;
+	delete[] animations->clips;
+	delete[] animations->phases;
+	delete animations;
+}
+
+int addAnimation(Animations* animations, int object, int clip, float phase) {
+	if (animations->count == animations->capacity) {
+		reserve(animations, animations->capacity * 2);
+	}
+	int i = animations->count++;
+	animations->objects[i] = object;
+	animations->clips[i] = clip;
+	animations->phases[i] = phase;
+	return i;
+}
+
+float chompMorph(const AnimationClip& clip, float time) {
+	float angleDiff = clip.closeAngle - clip.openAngle;
+	return ((sinf(time * (2.0f * pi) / clip.duration) + 1.0f) / 2.0f) * (angleDiff / clip.openAngle) + 1.0f;
+}
+
+void deformChomp(const ChompPose* pose, float morph, float* vertices, int stride) {
+	int i = 0;
+#ifdef ANIMATION_SSE
+	const __m128 morphVector = _mm_set1_ps(morph);
+	const __m128 piVector = _mm_set1_ps(pi);
+	const __m128 two = _mm_set1_ps(2.0f);
+	const __m128 halfPi = _mm_set1_ps(0.5f * pi);
+	float x[4], y[4];
+	for (; i + 4 <= pose->numVertices; i += 4) {
+		__m128 length = _mm_loadu_ps(&pose->lengths[i]);
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(&pose->angles[i]), morphVector);
+		__m128 side = _mm_loadu_ps(&pose->sides[i]);
+		__m128 c = _mm_add_ps(a, _mm_mul_ps(_mm_mul_ps(side, two), _mm_sub_ps(piVector, a)));
+
+		// cos(c) = sin(c + pi/2)
+		_mm_storeu_ps(x, _mm_mul_ps(sin4(_mm_add_ps(c, halfPi)), length));
+		_mm_storeu_ps(y, _mm_mul_ps(sin4(c), length));
+
+		// The vertex stream is interleaved, so the results are scattered
+		for (int j = 0; j < 4; ++j) {
+			float* v = &vertices[(i + j) * stride];
+			v[0] = x[j];
+			v[1] = -y[j];
+			v[2] = pose->depths[i + j];
+		}
+	}
+#endif
+	for (; i < pose->numVertices; ++i) {
+		float c = deformedAngle(pose->angles[i], pose->sides[i], morph);
+		float* v = &vertices[i * stride];
+		v[0] = cosf(c) * pose->lengths[i];
+		v[1] = -sinf(c) * pose->lengths[i];
+		v[2] = pose->depths[i];
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+// Parameters of the PacMan eating animation, angles in degrees and duration in seconds
+struct AnimationClip {
+	float openAngle;
+	float closeAngle;
+	float duration;
+};
+
+// Rest pose of a mesh in the polar form the eating animation works on, one entry per vertex
+struct ChompPose {
+	int numVertices;
+
+	// Distance from the z axis, angle to the x axis, which side of the mouth the vertex is on and z
+	float* lengths;
+	float* angles;
+	float* sides;
+	float* depths;
+};
+
+// Struct-of-arrays table of animated instances
+struct Animations {
+	int count;
+	int capacity;
+
+	// Object in the object table, clip index and time offset of each instance
+	int* objects;
+	int* clips;
+	float* phases;
+};
+
+// vertices points to the positions of the first vertex, stride is in floats
+ChompPose* createChompPose(const float* vertices, int numVertices, int stride);
+void deleteChompPose(ChompPose* pose);
+
+Animations* createAnimations(int capacity = 64);
+void deleteAnimations(Animations* animations);
+int addAnimation(Animations* animations, int object, int clip, float phase);
+
+// Scale factor for the vertex angles at the given time, the same as in pacman.vert.glsl
+float chompMorph(const AnimationClip& clip, float time);
+
+// Writes the deformed positions of all vertices to the first three floats of each vertex
+void deformChomp(const ChompPose* pose, float morph, float* vertices, int stride);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstring>
+
+// Replaces array by a new one with room for capacity elements, keeping the first count
+// Only for types that can be copied with memcpy
+template<class T> void grow(T*& array, int count, int capacity) {
+	T* bigger = new T[capacity];
+	if (count > 0) memcpy(bigger, array, count * sizeof(T));
+	delete[] array;
+	array = bigger;
+}
@@ -0,0 +1,223 @@
+#include "pch.h"
+#include "Clusters.h"
+#include "Arrays.h"
+#include "Parallel.h"
+#include <cmath>
+#include <cstring>
+
+namespace {
+	// Slices are cheap to bin, so give each thread a few of them
+	const int minSlicesPerThread = 4;
+
+	void reserve(Lights* lights, int capacity) {
+		if (capacity <= lights->capacity) return;
+		grow(lights->positions, lights->count * 3, capacity * 3);
+		grow(lights->colors, lights->count * 3, capacity * 3);
+		grow(lights->radii, lights->count, capacity);
+		grow(lights->powers, lights->count, capacity);
+		grow(lights->falloffs, lights->count, capacity);
+		lights->capacity = capacity;
+	}
+
+	float sliceDepth(const ClusterGrid* grid, int slice) {
+		return grid->nearPlane * powf(grid->farPlane / grid->nearPlane, slice / (float)clusterGridZ);
+	}
+
+	// Distance from value to the interval [min, max], 0 inside
+	inline float distanceToInterval(float value, float min, float max) {
+		if (value < min) return min - value;
+		if (value > max) return value - max;
+		return 0.0f;
+	}
+
+	// View space extent of every tile column (or row) in every slice, for one axis
+	// scale and offset are the projection terms of that axis: ndc = (scale * x) / depth + offset
+	void tileExtents(const ClusterGrid* grid, int numTiles, float scale, float offset, float* extents) {
+		for (int slice = 0; slice < clusterGridZ; ++slice) {
+			float depths[2] = { sliceDepth(grid, slice), sliceDepth(grid, slice + 1) };
+			for (int tile = 0; tile < numTiles; ++tile) {
+				float ndc[2] = { -1.0f + 2.0f * tile / numTiles, -1.0f + 2.0f * (tile + 1) / numTiles };
+				float* extent = &extents[(slice * numTiles + tile) * 2];
+				extent[0] = INFINITY;
+				extent[1] = -INFINITY;
+				for (int d = 0; d < 2; ++d) {
+					for (int n = 0; n < 2; ++n) {
+						float x = depths[d] * (ndc[n] - offset) / scale;
+						if (x < extent[0]) extent[0] = x;
+						if (x > extent[1]) extent[1] = x;
+					}
+				}
+			}
+		}
+	}
+}
+
+Lights* createLights(int capacity) {
+	Lights* lights = new Lights;
+	memset(lights, 0, sizeof(Lights));
+	reserve(lights, capacity > 0 ? capacity : 1);
+	return lights;
+}
+
+void deleteLights(Lights* lights) {
+	delete[] lights->positions;
+	delete[] lights->colors;
+	delete[] lights->radii;
+	delete[] lights->powers;
+	delete[] lights->falloffs;
+	delete lights;
+}
+
+int addLight(Lights* lights, float x, float y, float z, float r, float g, float b, float radius, float power, float falloff) {
+	if (lights->count == lights->capacity) {
+		reserve(lights, lights->capacity * 2);
+	}
+	int i = lights->count++;
+	lights->positions[i * 3 + 0] = x;
+	lights->positions[i * 3 + 1] = y;
+	lights->positions[i * 3 + 2] = z;
+	lights->colors[i * 3 + 0] = r;
+	lights->colors[i * 3 + 1] = g;
+	lights->colors[i * 3 + 2] = b;
+	lights->radii[i] = radius;
+	lights->powers[i] = power;
+	lights->falloffs[i] = falloff;
+	return i;
+}
+
+ClusterGrid* createClusterGrid(float nearPlane, float farPlane) {
+	ClusterGrid* grid = new ClusterGrid;
+	memset(grid, 0, sizeof(ClusterGrid));
+	grid->nearPlane = nearPlane;
+	grid->farPlane = farPlane;
+	grid->offsets = new int[numClusters];
+	grid->counts = new int[numClusters];
+	grid->lightIndices = new int[numClusters * maxLightsPerCluster];
+	grid->slots = new int[numClusters * maxLightsPerCluster];
+	memset(grid->offsets, 0, numClusters * sizeof(int));
+	memset(grid->counts, 0, numClusters * sizeof(int));
+	return grid;
+}
+
+void deleteClusterGrid(ClusterGrid* grid) {
+	delete[] grid->offsets;
+	delete[] grid->counts;
+	delete[] grid->lightIndices;
+	delete[] grid->slots;
+	delete[] grid->viewSpheres;
+	delete grid;
+}
+
+int clusterSlice(const ClusterGrid* grid, float depth) {
+	if (depth <= grid->nearPlane) return 0;
+	int slice = (int)(logf(depth / grid->nearPlane) / logf(grid->farPlane / grid->nearPlane) * clusterGridZ);
+	return slice < clusterGridZ ? slice : clusterGridZ - 1;
+}
+
+void assignLights(ClusterGrid* grid, const Lights* lights, const float* view, const float* projection, bool parallel) {
+	// For a perspective projection, w = projection[11] * z with projection[11] = 1 or -1, so the depth in
+	// front of the camera is projection[11] * z. The x and y terms of the projection are then
+	// ndc = (projection[0] * x) / depth + projection[11] * projection[8] and likewise for y.
+	float depthSign = projection[11] < 0.0f ? -1.0f : 1.0f;
+	float tilesX[clusterGridZ * clusterGridX * 2];
+	float tilesY[clusterGridZ * clusterGridY * 2];
+	tileExtents(grid, clusterGridX, projection[0], depthSign * projection[8], tilesX);
+	tileExtents(grid, clusterGridY, projection[5], depthSign * projection[9], tilesY);
+
+	// Light spheres in view space: x, y, depth and radius
+	if (lights->count > grid->viewSphereCapacity) {
+		delete[] grid->viewSpheres;
+		grid->viewSphereCapacity = lights->count;
+		grid->viewSpheres = new float[lights->count * 4];
+	}
+	float* spheres = grid->viewSpheres;
+	for (int l = 0; l < lights->count; ++l) {
+		const float* p = &lights->positions[l * 3];
+		spheres[l * 4 + 0] = view[0] * p[0] + view[4] * p[1] + view[8] * p[2] + view[12];
+		spheres[l * 4 + 1] = view[1] * p[0] + view[5] * p[1] + view[9] * p[2] + view[13];
+		spheres[l * 4 + 2] = depthSign * (view[2] * p[0] + view[6] * p[1] + view[10] * p[2] + view[14]);
+		spheres[l * 4 + 3] = lights->radii[l];
+	}
+
+	// Every thread owns whole slices, so the clusters can be filled without synchronization
+	int sliceOverflow[clusterGridZ];
+	int numLights = lights->count;
+	parallelFor(clusterGridZ, minSlicesPerThread, parallel, [&](int start, int end) {
+		for (int slice = start; slice < end; ++slice) {
+			int* counts = &grid->counts[slice * clusterGridX * clusterGridY];
+			int* slots = &grid->slots[slice * clusterGridX * clusterGridY * maxLightsPerCluster];
+			memset(counts, 0, clusterGridX * clusterGridY * sizeof(int));
+			sliceOverflow[slice] = 0;
+
+			float sliceNear = sliceDepth(grid, slice);
+			float sliceFar = sliceDepth(grid, slice + 1);
+			const float* extentsX = &tilesX[slice * clusterGridX * 2];
+			const float* extentsY = &tilesY[slice * clusterGridY * 2];
+			for (int l = 0; l < numLights; ++l) {
+				const float* sphere = &spheres[l * 4];
+				float radius2 = sphere[3] * sphere[3];
+				float dz = distanceToInterval(sphere[2], sliceNear, sliceFar);
+				float dz2 = dz * dz;
+				if (dz2 > radius2) continue;
+
+				for (int x = 0; x < clusterGridX; ++x) {
+					float dx = distanceToInterval(sphere[0], extentsX[x * 2], extentsX[x * 2 + 1]);
+					float dxz2 = dx * dx + dz2;
+					if (dxz2 > radius2) continue;
+
+					for (int y = 0; y < clusterGridY; ++y) {
+						float dy = distanceToInterval(sphere[1], extentsY[y * 2], extentsY[y * 2 + 1]);
+						if (dxz2 + dy * dy > radius2) continue;
+
+						int cluster = x + y * clusterGridX;
+						if (counts[cluster] == maxLightsPerCluster) {
+							++sliceOverflow[slice];
+							continue;
+						}
+						slots[cluster * maxLightsPerCluster + counts[cluster]++] = l;
+					}
+				}
+			}
+		}
+	});
+
+	// Compact the fixed size slots into one list
+	int offset = 0;
+	for (int cluster = 0; cluster < numClusters; ++cluster) {
+		grid->offsets[cluster] = offset;
+		memcpy(&grid->lightIndices[offset], &grid->slots[cluster * maxLightsPerCluster], grid->counts[cluster] * sizeof(int));
+		offset += grid->counts[cluster];
+	}
+	grid->numLightIndices = offset;
+	grid->truncated = 0;
+
+	grid->overflow = 0;
+	for (int slice = 0; slice < clusterGridZ; ++slice) {
+		grid->overflow += sliceOverflow[slice];
+	}
+}
+
+void truncateLightIndices(ClusterGrid* grid, int capacity) {
+	if (grid->numLightIndices <= capacity) return;
+	grid->truncated += grid->numLightIndices - capacity;
+	for (int cluster = 0; cluster < numClusters; ++cluster) {
+		int offset = grid->offsets[cluster];
+		if (offset + grid->counts[cluster] > capacity) {
+			grid->counts[cluster] = offset < capacity ? capacity - offset : 0;
+		}
+	}
+	grid->numLightIndices = capacity;
+}
+
+void lightsPerClusterHistogram(const ClusterGrid* grid, int* buckets, int numBuckets) {
+	memset(buckets, 0, numBuckets * sizeof(int));
+	for (int cluster = 0; cluster < numClusters; ++cluster) {
+		int count = grid->counts[cluster];
+		int bucket = 0;
+		while (count > 0) {
+			++bucket;
+			count >>= 1;
+		}
+		++buckets[bucket < numBuckets ? bucket : numBuckets - 1];
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+// Point lights in struct-of-arrays form
+struct Lights {
+	int count;
+	int capacity;
+
+	// 3 floats each for world space position and color
+	float* positions;
+	float* colors;
+	// Distance at which the light is cut off, the clusters are built with it
+	float* radii;
+	float* powers;
+	// Distance at which the light has faded to a quarter, the shaders fade it out completely by the radius
+	float* falloffs;
+};
+
+Lights* createLights(int capacity = 64);
+void deleteLights(Lights* lights);
+int addLight(Lights* lights, float x, float y, float z, float r, float g, float b, float radius, float power, float falloff);
+
+// The view frustum is split into tiles on screen and exponentially spaced slices in depth
+const int clusterGridX = 16;
+const int clusterGridY = 16;
+const int clusterGridZ = 32;
+const int numClusters = clusterGridX * clusterGridY * clusterGridZ;
+
+// Lights beyond this are dropped from a cluster
+const int maxLightsPerCluster = 128;
+
+// The shaders read the light indices from a square texture of this size, four indices per texel
+const int lightIndicesTextureSize = 256;
+const int maxLightIndices = lightIndicesTextureSize * lightIndicesTextureSize * 4;
+
+// Lights assigned to each cluster. Clusters are numbered x + y * clusterGridX + z * clusterGridX * clusterGridY
+// with y going up on screen and z going away from the camera.
+struct ClusterGrid {
+	// Depth range covered by the slices
+	float nearPlane;
+	float farPlane;
+
+	// The lights of cluster i are lightIndices[offsets[i]] to lightIndices[offsets[i] + counts[i] - 1]
+	int* offsets;
+	int* counts;
+	int* lightIndices;
+	int numLightIndices;
+
+	// Number of light assignments dropped because a cluster was full
+	int overflow;
+
+	// Number of light indices cut off by truncateLightIndices
+	int truncated;
+
+	// Working memory of assignLights
+	int* slots;
+	float* viewSpheres;
+	int viewSphereCapacity;
+};
+
+ClusterGrid* createClusterGrid(float nearPlane, float farPlane);
+void deleteClusterGrid(ClusterGrid* grid);
+
+// Slice the given view space depth falls into, clamped to the grid
+int clusterSlice(const ClusterGrid* grid, float depth);
+
+// Bins the lights into the clusters of the view frustum given by the column major view and perspective projection matrices
+// Lights are tested as spheres of their radius against the bounding box of each cluster
+void assignLights(ClusterGrid* grid, const Lights* lights, const float* view, const float* projection, bool parallel = true);
+
+// Cuts the light index list down to capacity entries and the counts of the clusters past the end to match
+void truncateLightIndices(ClusterGrid* grid, int capacity);
+
+// Counts clusters by number of lights: bucket 0 holds empty clusters, bucket i > 0 holds clusters
+// with 2^(i-1) to 2^i - 1 lights, the last bucket everything above
+void lightsPerClusterHistogram(const ClusterGrid* grid, int* buckets, int numBuckets);
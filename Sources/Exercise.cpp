@@ -8,9 +8,22 @@
 #include <Kore/Graphics4/Graphics.h>
 
 #include <Kore/Graphics4/PipelineState.h>
+#include <Kore/Graphics1/Image.h>
+#include <Kore/Log.h>
 
 #include "ObjLoader.h"
 #include "Memory.h"
+#include "MeshVertices.h"
+#include "Scene.h"
+#include "Transforms.h"
+#include "Animation.h"
+#include "Clusters.h"
+#include "Input.h"
+#include "Parallel.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 
 using namespace Kore;
 
@@ -30,10 +43,13 @@ struct SceneParameters {
 	// Current time
 	float time;
 
-	// PacMan parameters:
-	float openAngle = 146.0f;
-	float closeAngle = 180.0f;
-	float duration = 0.5f;
+	// Clustered lights, see Clusters.h and uploadLights()
+	Graphics4::Texture* lightData;
+	Graphics4::Texture* clusterData;
+	Graphics4::Texture* lightIndices;
+
+	// Near plane, slices per unit of log depth and the screen size, to find the cluster of a fragment
+	vec4 clusterDepth;
 };
 
 SceneParameters sceneParameters;
@@ -58,18 +74,15 @@ public:
 		pipeline->fragmentShader = fragmentShader;
 		pipeline->compile();
 		
-		pLocation = pipeline->getConstantLocation("P");
-		vLocation = pipeline->getConstantLocation("V");
-		mLocation = pipeline->getConstantLocation("M");
+		mvpLocation = pipeline->getConstantLocation("MVP");
 	}
 
 	// Update this program from the scene parameters
-	virtual void Set(const SceneParameters& parameters, const mat4& M, Graphics4::Texture* diffuse = nullptr, Graphics4::Texture* normalMap = nullptr)
+	// MVP is precomputed on the CPU for all objects at once, M is the world matrix of the object
+	virtual void Set(const SceneParameters& parameters, const mat4& M, const mat4& MVP, Graphics4::Texture* diffuse = nullptr, Graphics4::Texture* normalMap = nullptr)
 	{
 		Graphics4::setPipeline(pipeline);
-		Graphics4::setMatrix(mLocation, M);
-		Graphics4::setMatrix(vLocation, parameters.V);
-		Graphics4::setMatrix(pLocation, parameters.P);
+		Graphics4::setMatrix(mvpLocation, MVP);
 	}
 
 
@@ -79,9 +92,7 @@ protected:
 	Graphics4::PipelineState* pipeline;
 	
 	// Uniform locations - add more as you see fit
-	Graphics4::ConstantLocation pLocation;
-	Graphics4::ConstantLocation vLocation;
-	Graphics4::ConstantLocation mLocation;
+	Graphics4::ConstantLocation mvpLocation;
 };
 
 
@@ -92,22 +103,45 @@ public:
 	ShaderProgram_NormalMap(const char* vsFile, const char* fsFile, Graphics4::VertexStructure& structure)
 	: ShaderProgram(vsFile, fsFile, structure)
 	{
-		lightLocation = pipeline->getConstantLocation("light");
-//		eyeLocation = pipeline->getConstantLocation("eye");
+		mLocation = pipeline->getConstantLocation("M");
+		eyeLocation = pipeline->getConstantLocation("eye");
+		clusterGridLocation = pipeline->getConstantLocation("clusterGrid");
+		clusterDepthLocation = pipeline->getConstantLocation("clusterDepth");
+		lightIndicesSizeLocation = pipeline->getConstantLocation("lightIndicesSize");
 		tex = pipeline->getTextureUnit("tex");
 		normalMapTex = pipeline->getTextureUnit("normalMap");
+		lightDataTex = pipeline->getTextureUnit("lightData");
+		clusterDataTex = pipeline->getTextureUnit("clusterData");
+		lightIndicesTex = pipeline->getTextureUnit("lightIndices");
 			
 		Graphics4::setTextureAddressing(tex, Graphics4::U, Graphics4::Repeat);
 		Graphics4::setTextureAddressing(tex, Graphics4::V, Graphics4::Repeat);
+
+		// The light textures hold data, they must not be filtered
+		Graphics4::TextureUnit dataUnits[] = { lightDataTex, clusterDataTex, lightIndicesTex };
+		for (int i = 0; i < 3; ++i) {
+			Graphics4::setTextureAddressing(dataUnits[i], Graphics4::U, Graphics4::Clamp);
+			Graphics4::setTextureAddressing(dataUnits[i], Graphics4::V, Graphics4::Clamp);
+			Graphics4::setTextureMinificationFilter(dataUnits[i], Graphics4::PointFilter);
+			Graphics4::setTextureMagnificationFilter(dataUnits[i], Graphics4::PointFilter);
+			Graphics4::setTextureMipmapFilter(dataUnits[i], Graphics4::NoMipFilter);
+		}
 	}
 		
-	virtual void Set(const SceneParameters& parameters, const mat4& M, Graphics4::Texture* diffuse, Graphics4::Texture* normalMap) override
+	virtual void Set(const SceneParameters& parameters, const mat4& M, const mat4& MVP, Graphics4::Texture* diffuse, Graphics4::Texture* normalMap) override
 	{
-		ShaderProgram::Set(parameters, M);
+		ShaderProgram::Set(parameters, M, MVP);
+		Graphics4::setMatrix(mLocation, M);
 		Graphics4::setTexture(tex, diffuse);
 		Graphics4::setTexture(normalMapTex, normalMap);
-		Graphics4::setFloat3(lightLocation, parameters.light);
-//		Graphics4::setFloat3(eyeLocation, parameters.eye);
+		Graphics4::setFloat3(eyeLocation, parameters.eye);
+
+		Graphics4::setTexture(lightDataTex, parameters.lightData);
+		Graphics4::setTexture(clusterDataTex, parameters.clusterData);
+		Graphics4::setTexture(lightIndicesTex, parameters.lightIndices);
+		Graphics4::setFloat4(clusterGridLocation, (float)clusterGridX, (float)clusterGridY, (float)clusterGridZ, (float)parameters.lightData->width);
+		Graphics4::setFloat4(clusterDepthLocation, parameters.clusterDepth);
+		Graphics4::setFloat2(lightIndicesSizeLocation, (float)parameters.lightIndices->width, (float)parameters.lightIndices->height);
 	}
 		
 		
@@ -116,10 +150,16 @@ protected:
 	// Texture units
 	Graphics4::TextureUnit tex;
 	Graphics4::TextureUnit normalMapTex;
+	Graphics4::TextureUnit lightDataTex;
+	Graphics4::TextureUnit clusterDataTex;
+	Graphics4::TextureUnit lightIndicesTex;
 		
 	// Constant locations
-	Graphics4::ConstantLocation lightLocation;
-//	Graphics4::ConstantLocation eyeLocation;
+	Graphics4::ConstantLocation mLocation;
+	Graphics4::ConstantLocation eyeLocation;
+	Graphics4::ConstantLocation clusterGridLocation;
+	Graphics4::ConstantLocation clusterDepthLocation;
+	Graphics4::ConstantLocation lightIndicesSizeLocation;
 };
 
 
@@ -131,18 +171,28 @@ public:
 		: ShaderProgram(vsFile, fsFile, structure)
 	{
 		timeLocation = pipeline->getConstantLocation("time");
+		phaseLocation = pipeline->getConstantLocation("phase");
+		animateLocation = pipeline->getConstantLocation("animate");
 		durationLocation = pipeline->getConstantLocation("duration");
 		openAngleLocation = pipeline->getConstantLocation("openAngle");
 		closeAngleLocation = pipeline->getConstantLocation("closeAngle");
 	}
 
-	void Set(const SceneParameters& parameters, const mat4& M, Graphics4::Texture* diffuse, Graphics4::Texture* normalMap) override
+	void Set(const SceneParameters& parameters, const mat4& M, const mat4& MVP, Graphics4::Texture* diffuse, Graphics4::Texture* normalMap) override
 	{
-		ShaderProgram::Set(parameters, M);
+		ShaderProgram::Set(parameters, M, MVP);
 		Graphics4::setFloat(timeLocation, parameters.time);
-		Graphics4::setFloat(durationLocation, parameters.duration);
-		Graphics4::setFloat(openAngleLocation, parameters.openAngle);
-		Graphics4::setFloat(closeAngleLocation, parameters.closeAngle);
+	}
+
+	// Per instance animation parameters, call after Set
+	// If the vertices were already deformed on the CPU, the shader passes them through
+	void SetAnimation(const AnimationClip& clip, float phase, bool animate)
+	{
+		Graphics4::setFloat(phaseLocation, phase);
+		Graphics4::setFloat(animateLocation, animate ? 1.0f : 0.0f);
+		Graphics4::setFloat(durationLocation, clip.duration);
+		Graphics4::setFloat(openAngleLocation, clip.openAngle);
+		Graphics4::setFloat(closeAngleLocation, clip.closeAngle);
 	}
 
 
@@ -150,6 +200,8 @@ protected:
 
 	// Constant locations
 	Graphics4::ConstantLocation timeLocation;
+	Graphics4::ConstantLocation phaseLocation;
+	Graphics4::ConstantLocation animateLocation;
 	Graphics4::ConstantLocation durationLocation;
 	Graphics4::ConstantLocation openAngleLocation;
 	Graphics4::ConstantLocation closeAngleLocation;
@@ -158,35 +210,16 @@ protected:
 class MeshObject {
 public:
 
-	MeshObject(const char* meshFile, const char* textureFile, const char* normalMapFile, const Graphics4::VertexStructure& structure, ShaderProgram* shaderProgram, float scale = 1.0f)
-		: shaderProgram(shaderProgram), image(nullptr), normalMap(nullptr)
+	// Floats per vertex: position, texture coordinate, normal, tangent and bitangent
+	static const int stride = meshVertexStride;
+
+	MeshObject(const char* meshFile, const Graphics4::VertexStructure& structure, float scale = 1.0f)
 	{
 		mesh = loadObj(meshFile);
-		if (textureFile)
-		{
-			image = new Graphics4::Texture(textureFile);
-		}
-		if (normalMapFile)
-		{
-			normalMap = new Graphics4::Texture(normalMapFile);
-		}
 
 		vertexBuffer = new Graphics4::VertexBuffer(mesh->numVertices, structure, 0);
 		float* vertices = vertexBuffer->lock();
-		int stride = 3 + 2 + 3 + 3 + 3;
-		int strideInFile = 3 + 2 + 3;
-		for (int i = 0; i < mesh->numVertices; ++i) {
-			float* v = &vertices[i * stride];
-			float* meshV = &mesh->vertices[i * strideInFile];
-			v[0] = meshV[0] * scale;
-			v[1] = meshV[1] * scale;
-			v[2] = meshV[2] * scale;
-			v[3] = meshV[3];
-			v[4] = 1.0f - meshV[4];
-			v[5] = meshV[5];
-			v[6] = meshV[6];
-			v[7] = meshV[7];
-		}
+		buildVertices(mesh, scale, vertices);
 
 		indexBuffer = new Graphics4::IndexBuffer(mesh->numFaces * 3);
 		int* indices = indexBuffer->lock();
@@ -195,214 +228,461 @@ public:
 		}
 
 		// Calculate the tangent and bitangent vectors
-		// We don't index them here, we just copy them for each vertex
-		for (int i = 0; i < mesh->numIndices / 3; i++)
-		{
-			int index1 = indices[i * 3 + 0];
-			int index2 = indices[i * 3 + 1];
-			int index3 = indices[i * 3 + 2];
-
-			float* vData1 = &vertices[index1 * stride];
-			float* vData2 = &vertices[index2 * stride];
-			float* vData3 = &vertices[index3 * stride];
-
-			vec3 v1(vData1[0], vData1[1], vData1[2]);
-			vec3 v2(vData2[0], vData2[1], vData2[2]);
-			vec3 v3(vData3[0], vData3[1], vData3[2]);
-
-			vec2 uv1(vData1[3], vData1[4]);
-			vec2 uv2(vData2[3], vData2[4]);
-			vec2 uv3(vData3[3], vData3[4]);
-
-			// Edges of the triangle : position delta
-			vec3 deltaPos1 = v2 - v1;
-			vec3 deltaPos2 = v3 - v1;
-
-			// UV delta
-			vec2 deltaUV1 = uv2 - uv1;
-			vec2 deltaUV2 = uv3 - uv1;
-
-			/************************************************************************/
-			/* Exercise P6.1 a): Use deltaPos1/2 and deltaUV1/2 to calculate the     /
-			 * tangent and bitangent vectors                                         /
-			/************************************************************************/
-			float r = 1.0f / (deltaUV1.x() * deltaUV2.y() - deltaUV1.y() * deltaUV2.x());
-			vec3 normal(vData1[5], vData1[6], vData1[7]);
-			vec3 tangent = (deltaPos1 * deltaUV2.y() - deltaPos2 * deltaUV1.y())*r;
-			vec3 bitangent = (deltaPos2 * deltaUV1.x() - deltaPos1 * deltaUV2.x())*r;
-
-			// Don't forget to normalize them
-			tangent = tangent.normalize();
-			bitangent = bitangent.normalize();
-
-			// Gram-Schmidt orthogonalization
-			tangent = tangent - normal * normal.dot(tangent);
-
-			// Calculate handedness
-			if (normal.cross(tangent).dot(bitangent) < 0.0f)
-			{
-				tangent = tangent * -1.0f;
-			}
+		buildTangents(vertices, indices, mesh->numIndices);
 
-			// Write them out
-			vData1[8] = vData2[8] = vData3[8] = tangent.x();
-			vData1[9] = vData2[9] = vData3[9] = tangent.y();
-			vData1[10] = vData2[10] = vData3[10] = tangent.z();
-			
-			vData1[11] = vData2[11] = vData3[11] = bitangent.x();
-			vData1[12] = vData2[12] = vData3[12] = bitangent.y();
-			vData1[13] = vData2[13] = vData3[13] = bitangent.z(); 
-		} 
+		// Keep a copy of the finished vertices to fill streaming buffers from
+		restVertices = new float[mesh->numVertices * stride];
+		memcpy(restVertices, vertices, mesh->numVertices * stride * sizeof(float));
 
 		vertexBuffer->unlock();
 		indexBuffer->unlock();
-
-		M = mat4::Identity();
 	}
 
-	void render() {
-		shaderProgram->Set(sceneParameters, M, image, normalMap);
-		Graphics4::setVertexBuffer(*vertexBuffer);
+	// The shader program has to be set before
+	// Pass a buffer created with createStreamingBuffer to draw it instead of the rest pose
+	void render(Graphics4::VertexBuffer* vertices = nullptr) {
+		Graphics4::setVertexBuffer(vertices != nullptr ? *vertices : *vertexBuffer);
 		Graphics4::setIndexBuffer(*indexBuffer);
 		Graphics4::drawIndexedVertices();
 	}
 
-	// Model matrix of this object
-	mat4 M;
+	// Vertex buffer initialized to the rest pose, for the CPU to write deformed vertices to every frame
+	// The third argument is the instance step rate like above, this Kore version takes no usage hint for vertex buffers
+	Graphics4::VertexBuffer* createStreamingBuffer(const Graphics4::VertexStructure& structure) {
+		Graphics4::VertexBuffer* buffer = new Graphics4::VertexBuffer(mesh->numVertices, structure, 0);
+		memcpy(buffer->lock(), restVertices, mesh->numVertices * stride * sizeof(float));
+		buffer->unlock();
+		return buffer;
+	}
+
+	int numVertices() const {
+		return mesh->numVertices;
+	}
+
+	const float* vertices() const {
+		return restVertices;
+	}
 
 private:
 	Graphics4::VertexBuffer* vertexBuffer;
 	Graphics4::IndexBuffer* indexBuffer;
 	Mesh* mesh;
-	Graphics4::Texture* image;
-	Graphics4::Texture* normalMap;
-	ShaderProgram* shaderProgram;
+	float* restVertices;
 };
 
+// Conversions between Kore matrices and the column major float arrays of the transform system
+// mat4 stores its columns one after the other as well, so the floats are copied as they are
+static_assert(sizeof(mat4) == 16 * sizeof(float), "mat4 is expected to be 16 floats");
+
+mat4 toMat4(const float* m) {
+	mat4 result;
+	memcpy(result.matrix, m, sizeof(result.matrix));
+	return result;
+}
+
+void fromMat4(const mat4& m, float* out) {
+	memcpy(out, m.matrix, sizeof(m.matrix));
+}
+
+
 	const int width = 512;
 	const int height = 512;
+	const float nearPlane = 0.1f;
+	const float farPlane = 100.0f;
 	double startTime;
 
-	// null terminated array of MeshObject pointers
-	MeshObject* objects[] = { nullptr, nullptr, nullptr, nullptr, nullptr };
-	MeshObject* lightMesh = nullptr;
+	// Scene loaded from the scene file, the object table drives rendering
+	Scene* scene = nullptr;
+
+	// Resources referenced by the object table, indexed like the scene's mesh and texture tables
+	MeshObject** meshes = nullptr;
+	Graphics4::Texture** textures = nullptr;
+	ShaderProgram* programs[ProgramCount];
+	ShaderProgram_PacMan* pacManProgram = nullptr;
+
+	// Transforms of the scene's object table, which owns them
+	Transforms* transforms = nullptr;
+
+	// PacMan animation clips, the instances are spread over them
+	AnimationClip clips[] = {
+		{ 146.0f, 180.0f, 0.5f },
+		{ 150.0f, 180.0f, 0.35f },
+		{ 120.0f, 180.0f, 0.8f }
+	};
+	const int numClips = sizeof(clips) / sizeof(clips[0]);
+
+	// Every object rendered with the PacMan program is animated independently
+	Animations* animations = nullptr;
+	// Animation of each object, -1 if it is not animated
+	int* objectAnimations = nullptr;
+	// Rest pose of each animated mesh, nullptr for the others
+	ChompPose** chompPoses = nullptr;
+
+	// Deform on the CPU into two buffers per instance, alternating every frame so the one in use by the GPU is not touched
+	// Otherwise the vertex shader deforms the rest pose
+	bool deformOnCPU = false;
+	// Created the first time the CPU path is switched on, the default GPU path never needs them
+	Graphics4::VertexBuffer** streamingBuffers = nullptr;
+	Graphics4::VertexStructure streamingStructure;
+	int frame = 0;
+
+	// Deformation throughput and light assignment time since the last report
+	int reportFrames = 0;
+	double deformTime = 0.0;
+	double deformedVertices = 0.0;
+	double lightAssignmentTime = 0.0;
+	double lastReport = 0.0;
+
+	// The orbiting light comes first, followed by the point lights of the scene
+	Lights* lights = nullptr;
+	ClusterGrid* clusterGrid = nullptr;
+
+	// Keyboard and mouse events, pushed by the Kore callbacks or by the replay thread and consumed in update()
+	InputQueue* inputQueue = nullptr;
+	InputReplay* inputReplay = nullptr;
+	bool replayFinished = false;
+	FILE* inputRecording = nullptr;
+	int droppedInput = 0;
+
+	// The camera has been moved up to this time
+	double lastInputTime = 0.0;
+
+	// Events consumed this frame, their latency is known once the frame is presented
+	int frameInputEvents = 0;
+	double frameInputTimeSum = 0.0;
+	double frameOldestInput = 0.0;
+
+	// Latency from input to present since the last report
+	int latencyEvents = 0;
+	double latencySum = 0.0;
+	double maxLatency = 0.0;
+
+	// Lights beyond the width of the light data texture are ignored
+	const int maxLights = 1024;
+
+	float* textureRow(Graphics4::Texture* texture, u8* data, int row) {
+		return reinterpret_cast<float*>(data + row * texture->stride());
+	}
+
+	// Copies the lights and the cluster lists to the textures the normal mapping shader reads them from
+	void uploadLights() {
+		Graphics4::Texture* lightData = sceneParameters.lightData;
+		u8* data = lightData->lock();
+		float* positionRadius = textureRow(lightData, data, 0);
+		float* colorPower = textureRow(lightData, data, 1);
+		float* falloff = textureRow(lightData, data, 2);
+		for (int l = 0; l < lights->count; ++l) {
+			positionRadius[l * 4 + 0] = lights->positions[l * 3 + 0];
+			positionRadius[l * 4 + 1] = lights->positions[l * 3 + 1];
+			positionRadius[l * 4 + 2] = lights->positions[l * 3 + 2];
+			positionRadius[l * 4 + 3] = lights->radii[l];
+			colorPower[l * 4 + 0] = lights->colors[l * 3 + 0];
+			colorPower[l * 4 + 1] = lights->colors[l * 3 + 1];
+			colorPower[l * 4 + 2] = lights->colors[l * 3 + 2];
+			colorPower[l * 4 + 3] = lights->powers[l];
+			falloff[l * 4 + 0] = lights->falloffs[l];
+			falloff[l * 4 + 1] = 0.0f;
+			falloff[l * 4 + 2] = 0.0f;
+			falloff[l * 4 + 3] = 0.0f;
+		}
+		lightData->unlock();
+
+		// assignAndUploadLights already cut the indices down to what fits into the texture
+		Graphics4::Texture* lightIndices = sceneParameters.lightIndices;
+		data = lightIndices->lock();
+		for (int i = 0; i < clusterGrid->numLightIndices; ++i) {
+			int texel = i / 4;
+			textureRow(lightIndices, data, texel / lightIndices->width)[(texel % lightIndices->width) * 4 + i % 4] = (float)clusterGrid->lightIndices[i];
+		}
+		lightIndices->unlock();
+
+		// One row per slice, offset and count of each cluster
+		Graphics4::Texture* clusterData = sceneParameters.clusterData;
+		data = clusterData->lock();
+		for (int z = 0; z < clusterGridZ; ++z) {
+			float* row = textureRow(clusterData, data, z);
+			for (int xy = 0; xy < clusterGridX * clusterGridY; ++xy) {
+				int cluster = z * clusterGridX * clusterGridY + xy;
+				row[xy * 4 + 0] = (float)clusterGrid->offsets[cluster];
+				row[xy * 4 + 1] = (float)clusterGrid->counts[cluster];
+				row[xy * 4 + 2] = 0.0f;
+				row[xy * 4 + 3] = 0.0f;
+			}
+		}
+		clusterData->unlock();
+	}
+
+	void assignAndUploadLights() {
+		double start = System::time();
+		float view[16], projection[16];
+		fromMat4(sceneParameters.V, view);
+		fromMat4(sceneParameters.P, projection);
+		assignLights(clusterGrid, lights, view, projection);
+		truncateLightIndices(clusterGrid, maxLightIndices);
+		lightAssignmentTime += System::time() - start;
+
+		uploadLights();
+	}
+
+	void createStreamingBuffers() {
+		streamingBuffers = new Graphics4::VertexBuffer*[animations->count * 2];
+		for (int a = 0; a < animations->count; ++a) {
+			MeshObject* mesh = meshes[scene->objects.meshes[animations->objects[a]]];
+			streamingBuffers[a * 2 + 0] = mesh->createStreamingBuffer(streamingStructure);
+			streamingBuffers[a * 2 + 1] = mesh->createStreamingBuffer(streamingStructure);
+		}
+		log(Info, "Created %i vertex buffers for deforming on the CPU", animations->count * 2);
+	}
 
-	// Position of the mesh to use for normal mapping
-	vec3 normalMapModel = vec3(2.0, 0.0, 0.0);
+	void deformAnimations(float t) {
+		double start = System::time();
+		int buffer = frame & 1;
+		for (int a = 0; a < animations->count; ++a) {
+			int mesh = scene->objects.meshes[animations->objects[a]];
+			float morph = chompMorph(clips[animations->clips[a]], t + animations->phases[a]);
+			Graphics4::VertexBuffer* vertices = streamingBuffers[a * 2 + buffer];
+			deformChomp(chompPoses[mesh], morph, vertices->lock(), MeshObject::stride);
+			vertices->unlock();
+			deformedVertices += chompPoses[mesh]->numVertices;
+		}
+		deformTime += System::time() - start;
+	}
 
-	// Initial position of the light
-	vec3 lightStart = vec3(0, 1.95f, 3.0f);
+	void report(double now) {
+		if (now - lastReport < 1.0) return;
 
-	// Rotation rate of the light
-	float lightRotationRate = 1.0f;
+		const int numBuckets = 9;
+		int buckets[numBuckets];
+		lightsPerClusterHistogram(clusterGrid, buckets, numBuckets);
+		log(Info, "%i lights: %.3f ms per frame for the light assignment, %i dropped from full clusters, %i cut off", lights->count,
+			lightAssignmentTime * 1000.0 / reportFrames, clusterGrid->overflow, clusterGrid->truncated);
+		log(Info, "Clusters with 0: %i, 1: %i, 2-3: %i, 4-7: %i, 8-15: %i, 16-31: %i, 32-63: %i, 64-127: %i, 128+: %i lights",
+			buckets[0], buckets[1], buckets[2], buckets[3], buckets[4], buckets[5], buckets[6], buckets[7], buckets[8]);
+
+		if (deformOnCPU && deformTime > 0.0) {
+			log(Info, "%i animated instances on the CPU: %.1f million vertices/s, %.3f ms per frame",
+				animations->count, deformedVertices / deformTime / 1000000.0, deformTime * 1000.0 / reportFrames);
+		}
+		else {
+			log(Info, "%i animated instances on the GPU", animations->count);
+		}
+
+		if (latencyEvents > 0) {
+			log(Info, "%i input events: %.2f ms average, %.2f ms maximum from input to present",
+				latencyEvents, latencySum * 1000.0 / latencyEvents, maxLatency * 1000.0);
+		}
+		if (droppedInput > 0) {
+			log(Warning, "%i input events dropped, the input queue was full", droppedInput);
+		}
+		if (inputReplay != nullptr && !replayFinished && inputReplay->finished.load()) {
+			log(Info, "Input replay finished");
+			replayFinished = true;
+		}
+		deformTime = 0.0;
+		deformedVertices = 0.0;
+		lightAssignmentTime = 0.0;
+		latencyEvents = 0;
+		latencySum = 0.0;
+		maxLatency = 0.0;
+		droppedInput = 0;
+		reportFrames = 0;
+		lastReport = now;
+	}
 
 	
+	// Keys currently held, changed only by the events in the input queue
 	bool left, right, up, down, forward, backward;
-	
-	void update() {
-		float t = (float)(System::time() - startTime);
-		sceneParameters.time = t;
-		
-		// Animate the light point
-		mat3 rotation = mat3::RotationY(t * lightRotationRate);
-		sceneParameters.light = rotation * lightStart + normalMapModel;
 
-		const float speed = 0.05f;
+	// Camera speed in units per second
+	const float speed = 3.0f;
+
+	void moveEye(double seconds) {
+		float distance = speed * (float)seconds;
 		if (left) {
-			sceneParameters.eye.x() -= speed;
+			sceneParameters.eye.x() -= distance;
 		}
 		if (right) {
-			sceneParameters.eye.x() += speed;
+			sceneParameters.eye.x() += distance;
 		}
 		if (forward) {
-			sceneParameters.eye.z() += speed;
+			sceneParameters.eye.z() += distance;
 		}
 		if (backward) {
-			sceneParameters.eye.z() -= speed;
+			sceneParameters.eye.z() -= distance;
 		}
 		if (up) {
-			sceneParameters.eye.y() += speed;
+			sceneParameters.eye.y() += distance;
 		}
 		if (down) {
-			sceneParameters.eye.y() -= speed;
-		}
-		
-		Graphics4::begin();
-		Graphics4::clear(Graphics4::ClearColorFlag | Graphics4::ClearDepthFlag, 0xff000000, 1000.0f);
-		
-		sceneParameters.V = mat4::lookAt(sceneParameters.eye, vec3(0.0, 0.0, 0.0), vec3(0, 1.0, 0));
-		sceneParameters.P = mat4::Perspective(90.0, (float)width / (float)height, 0.1f, 100);
-
-		// Set the light position
-		lightMesh->M = Kore::mat4::Translation(sceneParameters.light.x(), sceneParameters.light.y(), sceneParameters.light.z());
-
-		MeshObject** current = &objects[0];
-		while (*current != nullptr) {
-			// Render the object
-			(*current)->render();
-			++current;
+			sceneParameters.eye.y() -= distance;
 		}
-
-		Graphics4::end();
-		Graphics4::swapBuffers();
 	}
 
-	void keyDown(KeyCode code) {
+	void applyInput(const InputEvent& event) {
+		if (event.type != InputKeyDown && event.type != InputKeyUp) {
+			// Mouse events are only recorded so far
+			return;
+		}
+		bool pressed = event.type == InputKeyDown;
+		KeyCode code = (KeyCode)event.code;
 		if (code == KeyLeft) {
-			left = true;
+			left = pressed;
 		}
 		else if (code == KeyRight) {
-			right = true;
+			right = pressed;
 		}
 		else if (code == KeyUp) {
-			forward = true;
+			forward = pressed;
 		}
 		else if (code == KeyDown) {
-			backward = true;
+			backward = pressed;
 		}
 		else if (code == KeyW) {
-			up = true;
+			up = pressed;
 		}
 		else if (code == KeyS) {
-			down = true;
+			down = pressed;
+		}
+		else if (code == KeyC && pressed) {
+			if (streamingBuffers == nullptr) createStreamingBuffers();
+			deformOnCPU = !deformOnCPU;
 		}
 	}
-	
-	void keyUp(KeyCode code) {
-		if (code == KeyLeft) {
-			left = false;
+
+	// Moves the camera up to now, changing direction at the time of each event instead of at frame boundaries
+	// so presses shorter than a frame still count and the path doesn't depend on the frame rate
+	void processInput(double now) {
+		frameInputEvents = 0;
+		frameInputTimeSum = 0.0;
+		InputEvent event;
+		while (popInput(inputQueue, &event)) {
+			// An event can't change the past, and one from after now is applied now
+			double time = event.time < lastInputTime ? lastInputTime : (event.time > now ? now : event.time);
+			moveEye(time - lastInputTime);
+			lastInputTime = time;
+			applyInput(event);
+
+			if (inputRecording != nullptr) {
+				recordInput(inputRecording, event, startTime);
+			}
+			if (frameInputEvents == 0) {
+				frameOldestInput = event.time;
+			}
+			++frameInputEvents;
+			frameInputTimeSum += event.time;
 		}
-		else if (code == KeyRight) {
-			right = false;
+		if (now > lastInputTime) {
+			moveEye(now - lastInputTime);
+			lastInputTime = now;
 		}
-		else if (code == KeyUp) {
-			forward = false;
+	}
+
+	void update() {
+		double now = System::time();
+		float t = (float)(now - startTime);
+		sceneParameters.time = t;
+		
+		// Animate the light point
+		mat3 rotation = mat3::RotationY(t * scene->lightRotationRate);
+		vec3 lightOffset(scene->lightOffset[0], scene->lightOffset[1], scene->lightOffset[2]);
+		vec3 lightCenter(scene->lightCenter[0], scene->lightCenter[1], scene->lightCenter[2]);
+		sceneParameters.light = rotation * lightOffset + lightCenter;
+
+		processInput(now);
+		
+		Graphics4::begin();
+		Graphics4::clear(Graphics4::ClearColorFlag | Graphics4::ClearDepthFlag, 0xff000000, 1000.0f);
+		
+		sceneParameters.V = mat4::lookAt(sceneParameters.eye, vec3(0.0, 0.0, 0.0), vec3(0, 1.0, 0));
+		sceneParameters.P = mat4::Perspective(90.0, (float)width / (float)height, nearPlane, farPlane);
+
+		// Set the light position
+		if (scene->lampObject >= 0) {
+			setPosition(transforms, scene->lampObject, sceneParameters.light.x(), sceneParameters.light.y(), sceneParameters.light.z());
 		}
-		else if (code == KeyDown) {
-			backward = false;
+		lights->positions[0] = sceneParameters.light.x();
+		lights->positions[1] = sceneParameters.light.y();
+		lights->positions[2] = sceneParameters.light.z();
+		assignAndUploadLights();
+
+		// World and MVP matrices of all changed objects in one batch
+		float viewProjection[16];
+		fromMat4(sceneParameters.P * sceneParameters.V, viewProjection);
+		updateTransforms(transforms, viewProjection);
+
+		if (deformOnCPU) {
+			deformAnimations(t);
 		}
-		else if (code == KeyW) {
-			up = false;
+
+		// Walk the object table in order, each array is read sequentially
+		const ObjectTable& objects = scene->objects;
+		for (int i = 0; i < objects.count; ++i) {
+			int diffuse = objects.diffuseTextures[i];
+			int normalMap = objects.normalMapTextures[i];
+			programs[objects.programs[i]]->Set(sceneParameters, toMat4(&transforms->world[i * 16]), toMat4(&transforms->mvp[i * 16]),
+				diffuse >= 0 ? textures[diffuse] : nullptr, normalMap >= 0 ? textures[normalMap] : nullptr);
+
+			int animation = objectAnimations[i];
+			if (animation < 0) {
+				meshes[objects.meshes[i]]->render();
+				continue;
+			}
+			pacManProgram->SetAnimation(clips[animations->clips[animation]], animations->phases[animation], !deformOnCPU);
+			meshes[objects.meshes[i]]->render(deformOnCPU ? streamingBuffers[animation * 2 + (frame & 1)] : nullptr);
 		}
-		else if (code == KeyS) {
-			down = false;
+
+		Graphics4::end();
+		Graphics4::swapBuffers();
+
+		// The closest to the photons the application can see
+		if (frameInputEvents > 0) {
+			double presented = System::time();
+			latencyEvents += frameInputEvents;
+			latencySum += presented * frameInputEvents - frameInputTimeSum;
+			if (presented - frameOldestInput > maxLatency) maxLatency = presented - frameOldestInput;
 		}
+
+		// Written out after the present, so the disk doesn't add to the latency
+		if (inputRecording != nullptr) flushInputRecording(inputRecording);
+
+		++frame;
+		++reportFrames;
+		report(System::time());
+	}
+
+	// The callbacks only queue the events, stamped with the time they were delivered
+	// While a recording is replayed, the replay thread is the only producer and live input is ignored
+	void pushEvent(int type, int code, int x, int y, int movementX, int movementY) {
+		if (inputReplay != nullptr) return;
+		InputEvent event = { System::time(), type, code, x, y, movementX, movementY };
+		if (!pushInput(inputQueue, event)) {
+			++droppedInput;
+		}
+	}
+
+	void keyDown(KeyCode code) {
+		pushEvent(InputKeyDown, code, 0, 0, 0, 0);
+	}
+	
+	void keyUp(KeyCode code) {
+		pushEvent(InputKeyUp, code, 0, 0, 0, 0);
 	}
 	
 	void mouseMove(int windowId, int x, int y, int movementX, int movementY) {
-
+		pushEvent(InputMouseMove, 0, x, y, movementX, movementY);
 	}
 	
 	void mousePress(int windowId, int button, int x, int y) {
-
+		pushEvent(InputMousePress, button, x, y, 0, 0);
 	}
 
 	void mouseRelease(int windowId, int button, int x, int y) {
-
+		pushEvent(InputMouseRelease, button, x, y, 0, 0);
 	}
 
-	void init() {
+	void init(const char* sceneFile) {
 		Memory::init();
+		startWorkers();
 		
 		// This defines the structure of your Vertex Buffer
 		Graphics4::VertexStructure structure;
@@ -415,30 +695,145 @@ private:
 		structure.add("bitangent", Graphics4::Float3VertexData);
 
 		// Set up the normal mapping shader
-		ShaderProgram* normalMappingProgram = new ShaderProgram_NormalMap("shader.vert", "shader.frag", structure);
+		programs[ProgramNormalMap] = new ShaderProgram_NormalMap("shader.vert", "shader.frag", structure);
 
 		// Set up the pacman shader
-		ShaderProgram* pacManProgram = new ShaderProgram_PacMan("pacman.vert", "pacman.frag", structure);
+		programs[ProgramPacMan] = pacManProgram = new ShaderProgram_PacMan("pacman.vert", "pacman.frag", structure);
+
+		scene = loadScene(sceneFile);
+		if (scene == nullptr) {
+			scene = createScene();
+		}
+
+		// Meshes and textures are shared by all objects referencing them
+		meshes = new MeshObject*[scene->numMeshes];
+		for (int i = 0; i < scene->numMeshes; ++i) {
+			meshes[i] = new MeshObject(scene->meshes[i].file, structure, scene->meshes[i].scale);
+		}
+		textures = new Graphics4::Texture*[scene->numTextures];
+		for (int i = 0; i < scene->numTextures; ++i) {
+			textures[i] = new Graphics4::Texture(scene->textures[i].file);
+		}
+
+		const ObjectTable& objects = scene->objects;
+		transforms = objects.transforms;
+
+		// Each PacMan gets its own clip and phase, so they don't chomp in sync
+		animations = createAnimations();
+		objectAnimations = new int[objects.count];
+		chompPoses = new ChompPose*[scene->numMeshes];
+		for (int i = 0; i < scene->numMeshes; ++i) {
+			chompPoses[i] = nullptr;
+		}
+		for (int i = 0; i < objects.count; ++i) {
+			objectAnimations[i] = -1;
+			if (objects.programs[i] != ProgramPacMan) continue;
+
+			int mesh = objects.meshes[i];
+			if (chompPoses[mesh] == nullptr) {
+				chompPoses[mesh] = createChompPose(meshes[mesh]->vertices(), meshes[mesh]->numVertices(), MeshObject::stride);
+			}
+			int clip = i % numClips;
+			float phase = fmodf(i * 0.618034f, 1.0f) * clips[clip].duration;
+			objectAnimations[i] = addAnimation(animations, i, clip, phase);
+		}
 
-		objects[0] = new MeshObject("box.obj", "199.JPG", "199_norm.JPG", structure, normalMappingProgram, 1.0f);
-		objects[0]->M = mat4::Translation(normalMapModel.x(), normalMapModel.y(), normalMapModel.z());
+		streamingStructure = structure;
+
+		// The orbiting light keeps the falloff and power it had as the only light, so it still lights the whole scene
+		// It is only cut off where power / (1 + d / falloff)^2 has dropped below 1/256
+		const float orbitFalloff = 5.0f;
+		const float orbitPower = 5.0f;
+		const float orbitRadius = orbitFalloff * (sqrtf(orbitPower * 256.0f) - 1.0f);
+		lights = createLights(scene->numPointLights + 1);
+		addLight(lights, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, orbitRadius, orbitPower, orbitFalloff);
+		for (int i = 0; i < scene->numPointLights; ++i) {
+			if (lights->count == maxLights) {
+				log(Warning, "Only %i lights are supported, ignoring the rest", maxLights);
+				break;
+			}
+			// Scene lights fall off over their whole radius
+			const ScenePointLight& light = scene->pointLights[i];
+			addLight(lights, light.position[0], light.position[1], light.position[2],
+				light.color[0], light.color[1], light.color[2], light.radius, light.power, light.radius);
+		}
+		clusterGrid = createClusterGrid(nearPlane, farPlane);
+		sceneParameters.lightData = new Graphics4::Texture(maxLights, 3, Graphics1::Image::RGBA128, false);
+		sceneParameters.clusterData = new Graphics4::Texture(clusterGridX * clusterGridY, clusterGridZ, Graphics1::Image::RGBA128, false);
+		sceneParameters.lightIndices = new Graphics4::Texture(lightIndicesTextureSize, lightIndicesTextureSize, Graphics1::Image::RGBA128, false);
+		sceneParameters.clusterDepth = vec4(nearPlane, clusterGridZ / logf(farPlane / nearPlane), (float)width, (float)height);
 
-		lightMesh = objects[1] = new MeshObject("ball.obj", "light_tex.png", "light_tex.png", structure, normalMappingProgram, 0.3f);
-		lightMesh->M = mat4::Translation(sceneParameters.light.x(), sceneParameters.light.y(), sceneParameters.light.z());
+		inputQueue = createInputQueue();
+
+		lastReport = System::time();
+	}
 
-		objects[2] = new MeshObject("PacMan.obj", nullptr, nullptr, structure, pacManProgram);
-		objects[2]->M = mat4::Translation(-2.0f, 0.0f, 0.0f) * mat4::RotationZ(Kore::pi);
+	// Writes a synthetic scene, baked if the file name ends with .bin
+	bool generate(int numObjects, const char* filename) {
+		Scene* generated = generateScene(numObjects);
+		int length = (int)strlen(filename);
+		bool baked = length > 4 && strcmp(filename + length - 4, ".bin") == 0;
+		bool success = baked ? bakeScene(generated, filename) : writeScene(generated, filename);
+		deleteScene(generated);
+		return success;
 	}
 }
 
+// Usage: [scene file]
+//        --record <input file> [scene file]
+//        --replay <input file> [scene file]
+//        --generate <number of objects> <output file>
+//        --bake <scene file> <output file>
 int kore(int argc, char** argv) {
+	if (argc >= 4 && strcmp(argv[1], "--generate") == 0) {
+		return generate(atoi(argv[2]), argv[3]) ? 0 : 1;
+	}
+	if (argc >= 4 && strcmp(argv[1], "--bake") == 0) {
+		Scene* source = loadScene(argv[2]);
+		bool success = source != nullptr && bakeScene(source, argv[3]);
+		if (source != nullptr) deleteScene(source);
+		return success ? 0 : 1;
+	}
+
+	const char* recordFile = nullptr;
+	const char* replayFile = nullptr;
+	int sceneArgument = 1;
+	if (argc >= 3 && strcmp(argv[1], "--record") == 0) {
+		recordFile = argv[2];
+		sceneArgument = 3;
+	}
+	else if (argc >= 3 && strcmp(argv[1], "--replay") == 0) {
+		replayFile = argv[2];
+		sceneArgument = 3;
+	}
+
 	Kore::System::init("Solution 6", width, height);
 
-	init();
+	init(argc > sceneArgument ? argv[sceneArgument] : "scene.txt");
+
+	InputEvent* replayEvents = nullptr;
+	int numReplayEvents = 0;
+	if (replayFile != nullptr) {
+		replayEvents = loadInputRecording(replayFile, &numReplayEvents);
+		if (replayEvents == nullptr) return 1;
+	}
+	if (recordFile != nullptr) {
+		inputRecording = createInputRecording(recordFile);
+		if (inputRecording == nullptr) {
+			log(Warning, "Could not create input recording %s", recordFile);
+			return 1;
+		}
+	}
 
 	Kore::System::setCallback(update);
 
 	startTime = System::time();
+	lastInputTime = startTime;
+
+	// Event times of the recording are relative to the start, like the ones written by recordInput
+	if (replayEvents != nullptr) {
+		inputReplay = startInputReplay(inputQueue, replayEvents, numReplayEvents, startTime, System::time);
+	}
 
 	Keyboard::the()->KeyDown = keyDown;
 	Keyboard::the()->KeyUp = keyUp;
@@ -448,5 +843,9 @@ int kore(int argc, char** argv) {
 
 	Kore::System::start();
 
+	if (inputReplay != nullptr) stopInputReplay(inputReplay);
+	if (inputRecording != nullptr) closeInputRecording(inputRecording);
+	stopWorkers();
+
 	return 0;
 }
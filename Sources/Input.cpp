@@ -0,0 +1,137 @@
+#include "pch.h"
+#include "Input.h"
+#include <Kore/IO/FileReader.h>
+#include <Kore/Log.h>
+#include <chrono>
+#include <cstring>
+
+using namespace Kore;
+
+namespace {
+	// "KINP" followed by the format version
+	const u32 recordingMagic = 0x504e494b;
+	const u32 recordingVersion = 1;
+
+	// Holds a few thousand events, far more than a frame delivers, so writing only happens in flushInputRecording
+	const int recordingBufferSize = 64 * 1024;
+
+	// Sleep in steps no longer than this, so stopping the replay doesn't wait for a long pause in the recording
+	const double maxReplaySleep = 0.01;
+
+	void replayEvents(InputReplay* replay) {
+		for (int i = 0; i < replay->count && !replay->stop.load(); ) {
+			InputEvent event = replay->events[i];
+			event.time += replay->startTime;
+			double wait = event.time - replay->clock();
+			if (wait > 0.0) {
+				std::this_thread::sleep_for(std::chrono::duration<double>(wait < maxReplaySleep ? wait : maxReplaySleep));
+				continue;
+			}
+			// Wait for the consumer instead of dropping events, the replay has to be complete to be reproducible
+			if (!pushInput(replay->queue, event)) {
+				std::this_thread::yield();
+				continue;
+			}
+			++i;
+		}
+		replay->finished.store(true);
+	}
+}
+
+InputQueue* createInputQueue() {
+	InputQueue* queue = new InputQueue;
+	queue->head.store(0);
+	queue->tail.store(0);
+	return queue;
+}
+
+void deleteInputQueue(InputQueue* queue) {
+	delete queue;
+}
+
+bool pushInput(InputQueue* queue, const InputEvent& event) {
+	unsigned tail = queue->tail.load(std::memory_order_relaxed);
+	if (tail - queue->head.load(std::memory_order_acquire) == (unsigned)inputQueueCapacity) {
+		return false;
+	}
+	queue->events[tail & (inputQueueCapacity - 1)] = event;
+	// Publishes the event to the consumer
+	queue->tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+bool popInput(InputQueue* queue, InputEvent* event) {
+	unsigned head = queue->head.load(std::memory_order_relaxed);
+	if (head == queue->tail.load(std::memory_order_acquire)) return false;
+	*event = queue->events[head & (inputQueueCapacity - 1)];
+	// Hands the slot back to the producer
+	queue->head.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+FILE* createInputRecording(const char* filename) {
+	FILE* recording = fopen(filename, "wb");
+	if (recording == nullptr) return nullptr;
+	setvbuf(recording, nullptr, _IOFBF, recordingBufferSize);
+	u32 header[2] = { recordingMagic, recordingVersion };
+	fwrite(header, sizeof(header), 1, recording);
+	return recording;
+}
+
+void recordInput(FILE* recording, const InputEvent& event, double startTime) {
+	InputEvent relative = event;
+	relative.time -= startTime;
+	fwrite(&relative, sizeof(relative), 1, recording);
+}
+
+void flushInputRecording(FILE* recording) {
+	fflush(recording);
+}
+
+bool closeInputRecording(FILE* recording) {
+	bool success = ferror(recording) == 0;
+	return fclose(recording) == 0 && success;
+}
+
+InputEvent* loadInputRecording(const char* filename, int* count) {
+	FileReader fileReader;
+	if (!fileReader.open(filename, FileReader::Asset)) {
+		log(Warning, "Could not open input recording %s", filename);
+		return nullptr;
+	}
+	int length = fileReader.size();
+	const char* data = reinterpret_cast<char*>(fileReader.readAll());
+
+	u32 header[2] = { 0, 0 };
+	if (length >= (int)sizeof(header)) memcpy(header, data, sizeof(header));
+	if (header[0] != recordingMagic || header[1] != recordingVersion) {
+		log(Warning, "%s is not an input recording of version %i", filename, recordingVersion);
+		return nullptr;
+	}
+
+	// A recording cut off while writing loses its last event
+	*count = (length - (int)sizeof(header)) / (int)sizeof(InputEvent);
+	InputEvent* events = new InputEvent[*count > 0 ? *count : 1];
+	if (*count > 0) memcpy(events, data + sizeof(header), *count * sizeof(InputEvent));
+	return events;
+}
+
+InputReplay* startInputReplay(InputQueue* queue, InputEvent* events, int count, double startTime, double (*clock)()) {
+	InputReplay* replay = new InputReplay;
+	replay->queue = queue;
+	replay->events = events;
+	replay->count = count;
+	replay->startTime = startTime;
+	replay->clock = clock;
+	replay->stop.store(false);
+	replay->finished.store(false);
+	replay->thread = std::thread(replayEvents, replay);
+	return replay;
+}
+
+void stopInputReplay(InputReplay* replay) {
+	replay->stop.store(true);
+	replay->thread.join();
+	delete[] replay->events;
+	delete replay;
+}
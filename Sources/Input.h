@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+enum InputEventType {
+	InputKeyDown = 0,
+	InputKeyUp = 1,
+	InputMouseMove = 2,
+	InputMousePress = 3,
+	InputMouseRelease = 4
+};
+
+// A keyboard or mouse event, time is in seconds on the clock of whoever produced it
+struct InputEvent {
+	double time;
+	int type;
+	// Key code or mouse button
+	int code;
+	int x;
+	int y;
+	int movementX;
+	int movementY;
+};
+
+// Must be a power of two
+const int inputQueueCapacity = 1024;
+
+// Single producer, single consumer ring buffer
+// One thread may push and one other thread may pop at the same time without locking
+struct InputQueue {
+	InputEvent events[inputQueueCapacity];
+
+	// Both only ever increase, the slot is the value modulo the capacity
+	// Written by the consumer
+	std::atomic<unsigned> head;
+	// Keep the indices on separate cache lines so producer and consumer don't contend
+	char padding[64];
+	// Written by the producer
+	std::atomic<unsigned> tail;
+};
+
+InputQueue* createInputQueue();
+void deleteInputQueue(InputQueue* queue);
+
+// Producer side, returns false if the queue is full
+bool pushInput(InputQueue* queue, const InputEvent& event);
+// Consumer side, returns false if the queue is empty
+bool popInput(InputQueue* queue, InputEvent* event);
+
+// Recorded event streams: "KINP", the format version and the events, times relative to the start of the recording
+// Events are buffered and written out by flushInputRecording, which the application calls once per frame,
+// so a killed application loses at most the events of its last frame
+FILE* createInputRecording(const char* filename);
+void recordInput(FILE* recording, const InputEvent& event, double startTime);
+void flushInputRecording(FILE* recording);
+bool closeInputRecording(FILE* recording);
+
+// Returns the events of a recording or nullptr, delete[] them when done
+InputEvent* loadInputRecording(const char* filename, int* count);
+
+// Replays recorded events into a queue from a thread of its own, each at its recorded time after startTime
+// The replay thread is the producer of the queue, nothing else may push while it runs
+struct InputReplay {
+	InputQueue* queue;
+	InputEvent* events;
+	int count;
+	double startTime;
+	double (*clock)();
+
+	std::atomic<bool> stop;
+	std::atomic<bool> finished;
+	std::thread thread;
+};
+
+// clock has to return the time in seconds on the clock the consumer uses
+InputReplay* startInputReplay(InputQueue* queue, InputEvent* events, int count, double startTime, double (*clock)());
+// Stops the thread and deletes the replay including the events
+void stopInputReplay(InputReplay* replay);
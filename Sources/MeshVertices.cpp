@@ -0,0 +1,93 @@
+#include "pch.h"
+#include "MeshVertices.h"
+#include "ObjLoader.h"
+#include <cmath>
+
+namespace {
+	const int strideInFile = 3 + 2 + 3;
+
+	inline float dot(const float* a, const float* b) {
+		return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	}
+
+	inline void normalize(float* v) {
+		float length = sqrtf(dot(v, v));
+		v[0] /= length;
+		v[1] /= length;
+		v[2] /= length;
+	}
+}
+
+void buildVertices(const Mesh* mesh, float scale, float* vertices) {
+	for (int i = 0; i < mesh->numVertices; ++i) {
+		float* v = &vertices[i * meshVertexStride];
+		const float* meshV = &mesh->vertices[i * strideInFile];
+		v[0] = meshV[0] * scale;
+		v[1] = meshV[1] * scale;
+		v[2] = meshV[2] * scale;
+		v[3] = meshV[3];
+		v[4] = 1.0f - meshV[4];
+		v[5] = meshV[5];
+		v[6] = meshV[6];
+		v[7] = meshV[7];
+	}
+}
+
+void buildTangents(float* vertices, const int* indices, int numIndices) {
+	// We don't index them here, we just copy them for each vertex
+	for (int i = 0; i < numIndices / 3; i++)
+	{
+		float* vData1 = &vertices[indices[i * 3 + 0] * meshVertexStride];
+		float* vData2 = &vertices[indices[i * 3 + 1] * meshVertexStride];
+		float* vData3 = &vertices[indices[i * 3 + 2] * meshVertexStride];
+
+		// Edges of the triangle : position delta
+		float deltaPos1[3] = { vData2[0] - vData1[0], vData2[1] - vData1[1], vData2[2] - vData1[2] };
+		float deltaPos2[3] = { vData3[0] - vData1[0], vData3[1] - vData1[1], vData3[2] - vData1[2] };
+
+		// UV delta
+		float deltaUV1[2] = { vData2[3] - vData1[3], vData2[4] - vData1[4] };
+		float deltaUV2[2] = { vData3[3] - vData1[3], vData3[4] - vData1[4] };
+
+		/************************************************************************/
+		/* Exercise P6.1 a): Use deltaPos1/2 and deltaUV1/2 to calculate the     /
+		 * tangent and bitangent vectors                                         /
+		/************************************************************************/
+		float r = 1.0f / (deltaUV1[0] * deltaUV2[1] - deltaUV1[1] * deltaUV2[0]);
+		const float* normal = &vData1[5];
+		float tangent[3], bitangent[3];
+		for (int k = 0; k < 3; ++k) {
+			tangent[k] = (deltaPos1[k] * deltaUV2[1] - deltaPos2[k] * deltaUV1[1]) * r;
+			bitangent[k] = (deltaPos2[k] * deltaUV1[0] - deltaPos1[k] * deltaUV2[0]) * r;
+		}
+
+		// Don't forget to normalize them
+		normalize(tangent);
+		normalize(bitangent);
+
+		// Gram-Schmidt orthogonalization
+		float normalDotTangent = dot(normal, tangent);
+		for (int k = 0; k < 3; ++k) {
+			tangent[k] -= normal[k] * normalDotTangent;
+		}
+
+		// Calculate handedness
+		float normalCrossTangent[3] = {
+			normal[1] * tangent[2] - normal[2] * tangent[1],
+			normal[2] * tangent[0] - normal[0] * tangent[2],
+			normal[0] * tangent[1] - normal[1] * tangent[0]
+		};
+		if (dot(normalCrossTangent, bitangent) < 0.0f)
+		{
+			for (int k = 0; k < 3; ++k) {
+				tangent[k] = -tangent[k];
+			}
+		}
+
+		// Write them out
+		for (int k = 0; k < 3; ++k) {
+			vData1[8 + k] = vData2[8 + k] = vData3[8 + k] = tangent[k];
+			vData1[11 + k] = vData2[11 + k] = vData3[11 + k] = bitangent[k];
+		}
+	}
+}
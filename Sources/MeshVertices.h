@@ -0,0 +1,13 @@
+#pragma once
+
+struct Mesh;
+
+// Floats per vertex in the vertex buffers: position, texture coordinate, normal, tangent and bitangent
+const int meshVertexStride = 3 + 2 + 3 + 3 + 3;
+
+// Fills in position, texture coordinate and normal of every vertex of the mesh
+// Positions are scaled, v is flipped to the texture orientation of the renderer
+void buildVertices(const Mesh* mesh, float scale, float* vertices);
+
+// Calculates tangent and bitangent of every triangle and writes them to its vertices
+void buildTangents(float* vertices, const int* indices, int numIndices);
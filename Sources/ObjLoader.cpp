@@ -7,17 +7,27 @@
 using namespace Kore;
 
 namespace {
+	// Returns a copy of the text after position i up to the next delimiter or the end of s and moves i to where it ended
+	// Start with i = -1, returns nullptr once s is used up
 	char* tokenize(char* s, char delimiter, int& i) {
 		int lastIndex = i;
-		char* index = strchr(s + lastIndex + 1, delimiter);
-		if (index == nullptr) {
+		if (lastIndex >= 0 && s[lastIndex] == 0) {
 			return nullptr;
 		}
+		char* start = s + lastIndex + 1;
+		char* index = strchr(start, delimiter);
+		if (index == nullptr) {
+			// The last line does not need to end with a delimiter
+			index = start + strlen(start);
+			if (index == start) {
+				return nullptr;
+			}
+		}
 		int newIndex = (int)(index - s);
 		i = newIndex;
-		int length = newIndex - lastIndex;
+		int length = newIndex - lastIndex - 1;
 		char* token = new char[length + 1];
-		strncpy(token, s + lastIndex + 1, length);
+		memcpy(token, start, length);
 		token[length] = 0;
 		return token;
 	}
@@ -25,13 +35,14 @@ namespace {
 	int countFirstCharLines(char* source, const char* start) {
 		int count = 0;
 
-		int index = 0;
+		int index = -1;
 		char* line = tokenize(source, '\n', index);
 
 		while (line != nullptr) {
 			char *pch = strstr(line, start);
 			if (pch == line)
 				count++;
+			delete[] line;
 			line = tokenize(source, '\n', index);
 		}
 		return count;
@@ -58,13 +69,14 @@ namespace {
 	int countFaces(char* source) {
 		int count = 0;
 
-		int index = 0;
+		int index = -1;
 		char* line = tokenize(source, '\n', index);
 
 		while (line != nullptr) {
 			if (line[0] == 'f') {
 				count += countFacesInLine(line);
 			}
+			delete[] line;
 			line = tokenize(source, '\n', index);
 		}
 		return count;
@@ -82,16 +94,34 @@ namespace {
 		return countFirstCharLines(source, "vt ");
 	}
 
+	// Missing values are read as 0
+	float parseFloat(char* token) {
+		if (token == nullptr) return 0.0f;
+		return (float)strtod(token, nullptr);
+	}
+
+	// Parses a 1 based index into a list of count entries, returns the 0 based index or -1 if it is out of range
+	int parseIndex(char* token, char** endPtr, int count) {
+		long index = strtol(token, endPtr, 10);
+		if (*endPtr == token || index < 1 || index > count) {
+			return -1;
+		}
+		return (int)index - 1;
+	}
+
 	void parseVertex(Mesh* mesh, char* line) {
-		char* token;
+		// The line counts are only a guess for malformed files
+		if (mesh->numVertices == mesh->maxVertices) return;
+
 		for (int i = 0; i < 3; i++) {
-			token = strtok(nullptr, " ");
-			mesh->curVertex[i] = (float)strtod(token, nullptr);
+			mesh->curVertex[i] = parseFloat(strtok(nullptr, " "));
 		}
 
+		// Zero the uv and normal in case no face sets them
 		mesh->curVertex += 3;
-		mesh->curVertex[0] = 0;
-		mesh->curVertex[1] = 0;
+		for (int i = 0; i < 5; i++) {
+			mesh->curVertex[i] = 0;
+		}
 		mesh->curVertex += 5;
 
 		mesh->numVertices++;
@@ -108,88 +138,106 @@ namespace {
 		mesh->vertices[(index * 8) + 7] = z;
 	}
 
-	void parseFace(Mesh* mesh, char* line) {
-		char* token;
-		int verts[4];
-		int uvIndex[4];
-		int normalIndex[4];
-		bool hasUV[4];
-		bool hasNormal[4];
-		for (int i = 0; i < 3; i++) {
-			token = strtok(nullptr, " ");
-			char* endPtr;
-			verts[i] = (int)strtol(token, &endPtr, 0) - 1;
-			if (endPtr[0] == '/') {
-				// Parse the uv
-				hasUV[i] = true;
-				uvIndex[i] = (int)strtol(endPtr + 1, &endPtr, 0) - 1;
-			} else {
-				// There is no uv
-				hasUV[i] = false;
-				hasNormal[i] = false;
-			}
-			if (endPtr[0] == '/') {
-				hasNormal[i] = true;
-				normalIndex[i] = (int)strtol(endPtr + 1, nullptr, 0) - 1;
-			} 
-		}
-		token = strtok(nullptr, " ");
-		//char* result;
-		if (token != nullptr) {
-			verts[3] = (int)strtol(token, nullptr, 0) - 1;
-			// We have a quad
-			mesh->curIndex[0] = verts[0];
-			mesh->curIndex[1] = verts[1];
-			mesh->curIndex[2] = verts[2];
-			mesh->curIndex += 3;
-			mesh->curIndex[0] = verts[2];
-			mesh->curIndex[1] = verts[3];
-			mesh->curIndex[2] = verts[0];
-			mesh->curIndex += 3;
-			mesh->numFaces += 2;
-			mesh->numIndices += 6;
+	// One corner of a face, uv and normal are -1 if not given
+	struct FaceVertex {
+		int vertex;
+		int uv;
+		int normal;
+	};
+
+	// Parses v, v/vt, v//vn or v/vt/vn, the indices have to refer to data read before
+	bool parseFaceVertex(Mesh* mesh, char* token, FaceVertex& faceVertex) {
+		char* endPtr;
+		faceVertex.vertex = parseIndex(token, &endPtr, mesh->numVertices);
+		faceVertex.uv = -1;
+		faceVertex.normal = -1;
+		if (faceVertex.vertex < 0) return false;
+		if (endPtr[0] != '/') return true;
+
+		// Parse the uv, unless it is left out
+		token = endPtr + 1;
+		if (token[0] != '/') {
+			faceVertex.uv = parseIndex(token, &endPtr, (int)(mesh->curUV - mesh->uvs) / 2);
+			if (faceVertex.uv < 0) return false;
+			if (endPtr[0] != '/') return true;
 		}
 		else {
-			// We have a triangle
-			for (int i = 0; i < 3; i++) {
-				mesh->curIndex[i] = verts[i];
+			endPtr = token;
+		}
+
+		token = endPtr + 1;
+		faceVertex.normal = parseIndex(token, &endPtr, (int)(mesh->curNormal - mesh->normals) / 3);
+		return faceVertex.normal >= 0;
+	}
+
+	void parseFace(Mesh* mesh, char* line) {
+		FaceVertex verts[4];
+		int count = 0;
 
-				if (!hasUV[i]) continue;
+		// Faces with more than four vertices are cut off, like in countFacesInLine
+		for (char* token = strtok(nullptr, " "); token != nullptr && count < 4; token = strtok(nullptr, " ")) {
+			if (!parseFaceVertex(mesh, token, verts[count])) return;
+			count++;
+		}
+		if (count < 3) return;
+
+		// A quad is split into two triangles
+		const int order[] = { 0, 1, 2, 2, 3, 0 };
+		int numIndices = count == 4 ? 6 : 3;
+		if (mesh->numIndices + numIndices > mesh->maxIndices) return;
 
-				// Set the UVs
-				setUV(mesh, mesh->curIndex[i], mesh->uvs[uvIndex[i] * 2], mesh->uvs[(uvIndex[i] * 2) + 1]);
+		for (int i = 0; i < count; i++) {
+			const FaceVertex& v = verts[i];
 
-				if (!hasNormal[i]) continue;
+			// Set the UVs
+			if (v.uv >= 0) {
+				setUV(mesh, v.vertex, mesh->uvs[v.uv * 2], mesh->uvs[(v.uv * 2) + 1]);
+			}
 
-				// Set the Normal
-				setNormal(mesh, mesh->curIndex[i], mesh->normals[normalIndex[i] * 3], mesh->normals[normalIndex[i] * 3 + 1], mesh->normals[normalIndex[i] * 3 + 2]);
+			// Set the Normal
+			if (v.normal >= 0) {
+				setNormal(mesh, v.vertex, mesh->normals[v.normal * 3], mesh->normals[v.normal * 3 + 1], mesh->normals[v.normal * 3 + 2]);
 			}
-			mesh->curIndex += 3;
-			mesh->numFaces += 1;
-			mesh->numIndices += 3;
 		}
+
+		for (int i = 0; i < numIndices; i++) {
+			mesh->curIndex[i] = verts[order[i]].vertex;
+		}
+		mesh->curIndex += numIndices;
+		mesh->numFaces += numIndices / 3;
+		mesh->numIndices += numIndices;
 	}
 
 	void parseUV(Mesh* mesh, char* line) {
-		char* token;
+		if (mesh->curUV == mesh->uvs + mesh->numUVs * 2) return;
+
 		for (int i = 0; i < 2; i++) {
-			token = strtok(nullptr, " ");
-			*mesh->curUV = (float)strtod(token, nullptr);
+			*mesh->curUV = parseFloat(strtok(nullptr, " "));
 			mesh->curUV++;
 		}
 	}
 
 	void parseNormal(Mesh* mesh, char* line) {
-		char* token;
+		if (mesh->curNormal == mesh->normals + mesh->numNormals * 3) return;
+
 		for (int i = 0; i < 3; i++) {
-			token = strtok(nullptr, " ");
-			*mesh->curNormal = (float)strtod(token, nullptr);
+			*mesh->curNormal = parseFloat(strtok(nullptr, " "));
 			mesh->curNormal++;
 		}
 	}
 
 	void parseLine(Mesh* mesh, char* line) {
+		// Files with Windows line endings
+		int length = (int)strlen(line);
+		if (length > 0 && line[length - 1] == '\r') {
+			line[length - 1] = 0;
+		}
+
 		char* token = strtok(line, " ");
+		if (token == nullptr) {
+			// Empty line
+			return;
+		}
 		if (strcmp(token, "v") == 0) {
 			// Read some vertex data
 			parseVertex(mesh, line);
@@ -204,25 +252,29 @@ namespace {
 			parseNormal(mesh, line);
 		}
 
-		// Ignore all other commands (for now)	
+		// Ignore all other commands (for now)
 	}
 }
 
 Mesh* loadObj(const char* filename) {
 	FileReader fileReader(filename, FileReader::Asset);
-	void* data = fileReader.readAll();
-	int length = fileReader.size() + 1;
-	char* source = new char[length];
-	for (int i = 0; i < length; ++i) source[i] = reinterpret_cast<char*>(data)[i];
+	return parseObj(reinterpret_cast<char*>(fileReader.readAll()), fileReader.size());
+}
+
+Mesh* parseObj(const char* data, int length) {
+	char* source = new char[length + 1];
+	if (length > 0) memcpy(source, data, length);
 	source[length] = 0;
-	
+
 	Mesh* mesh = new Mesh;
 	mesh->numIndices = 0;
 
 	int vertices = countVertices(source);
+	mesh->maxVertices = vertices;
 	mesh->vertices = new float[vertices * 8];
 	mesh->curVertex = mesh->vertices;
 	int faces = countFaces(source);
+	mesh->maxIndices = faces * 3;
 	mesh->indices = new int[faces * 3];
 	mesh->curIndex = mesh->indices;
 	mesh->numUVs = countUVs(source);
@@ -235,20 +287,29 @@ Mesh* loadObj(const char* filename) {
 
 
 
-	
+
 	mesh->numVertices = 0;
 	mesh->numFaces = 0;
-	
-	
-	
-	int index = 0;
+
+
+
+	int index = -1;
 	char* line = tokenize(source, '\n', index);
-	
+
 	while (line != nullptr) {
 		parseLine(mesh, line);
 		delete[] line;
 		line = tokenize(source, '\n', index);
 	}
 
+	delete[] source;
 	return mesh;
 }
+
+void deleteMesh(Mesh* mesh) {
+	delete[] mesh->vertices;
+	delete[] mesh->indices;
+	delete[] mesh->uvs;
+	delete[] mesh->normals;
+	delete mesh;
+}
@@ -17,6 +17,14 @@ struct Mesh {
 	int* curIndex;
 	float* curUV;
 	float* curNormal;
+	int maxVertices;
+	int maxIndices;
 };
 
 Mesh* loadObj(const char* filename);
+
+// Parses an obj file already in memory, data does not need to be null terminated
+// Malformed lines and faces referring to missing data are skipped
+Mesh* parseObj(const char* data, int length);
+
+void deleteMesh(Mesh* mesh);
@@ -0,0 +1,136 @@
+#include "pch.h"
+#include "Parallel.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace {
+	struct WorkerPool {
+		std::thread* workers;
+		int count;
+
+		std::mutex mutex;
+		std::condition_variable jobStarted;
+		std::condition_variable jobFinished;
+		bool stopping;
+
+		// The current job, only changed under the mutex while no worker is busy with the previous one
+		unsigned generation;
+		void (*job)(void*, int);
+		void* jobData;
+		int jobCount;
+		std::atomic<int> nextIndex;
+
+		// Indices not done yet and workers still inside the current job, both guarded by the mutex
+		int remaining;
+		int busy;
+	};
+
+	// Allocated instead of static, so exiting without stopWorkers does not destroy it under the waiting workers
+	WorkerPool* pool = nullptr;
+
+	// Takes indices until there are none left, returns how many this thread ran
+	int runIndices(void (*function)(void*, int), void* data, int count) {
+		int finished = 0;
+		for (int index = pool->nextIndex++; index < count; index = pool->nextIndex++) {
+			function(data, index);
+			++finished;
+		}
+		return finished;
+	}
+
+	void work() {
+		unsigned seen = 0;
+		for (;;) {
+			void (*function)(void*, int);
+			void* data;
+			int count;
+			{
+				std::unique_lock<std::mutex> lock(pool->mutex);
+				// A job without remaining indices is over, its caller may already be gone
+				pool->jobStarted.wait(lock, [&]() { return pool->stopping || (pool->generation != seen && pool->remaining > 0); });
+				if (pool->stopping) return;
+				seen = pool->generation;
+				function = pool->job;
+				data = pool->jobData;
+				count = pool->jobCount;
+				++pool->busy;
+			}
+
+			int finished = runIndices(function, data, count);
+
+			std::lock_guard<std::mutex> lock(pool->mutex);
+			pool->remaining -= finished;
+			--pool->busy;
+			if (pool->remaining == 0 && pool->busy == 0) pool->jobFinished.notify_one();
+		}
+	}
+}
+
+void startWorkers(int count) {
+	if (pool != nullptr) return;
+	if (count < 0) count = (int)std::thread::hardware_concurrency() - 1;
+	if (count < 1) return;
+
+	pool = new WorkerPool;
+	pool->stopping = false;
+	pool->generation = 0;
+	pool->job = nullptr;
+	pool->jobData = nullptr;
+	pool->jobCount = 0;
+	pool->nextIndex = 0;
+	pool->remaining = 0;
+	pool->busy = 0;
+	pool->count = count;
+	pool->workers = new std::thread[count];
+	for (int i = 0; i < count; ++i) {
+		pool->workers[i] = std::thread(work);
+	}
+}
+
+void stopWorkers() {
+	if (pool == nullptr) return;
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->stopping = true;
+	}
+	pool->jobStarted.notify_all();
+	for (int i = 0; i < pool->count; ++i) {
+		pool->workers[i].join();
+	}
+	delete[] pool->workers;
+	delete pool;
+	pool = nullptr;
+}
+
+int numWorkers() {
+	return pool == nullptr ? 0 : pool->count;
+}
+
+void runOnWorkers(int count, void (*function)(void* data, int index), void* data) {
+	if (pool == nullptr) {
+		for (int index = 0; index < count; ++index) {
+			function(data, index);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->job = function;
+		pool->jobData = data;
+		pool->jobCount = count;
+		pool->nextIndex = 0;
+		pool->remaining = count;
+		++pool->generation;
+	}
+	pool->jobStarted.notify_all();
+
+	int finished = runIndices(function, data, count);
+
+	// Workers may still be looking at the job after the last index is done, wait for them too
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	pool->remaining -= finished;
+	pool->jobFinished.wait(lock, []() { return pool->remaining == 0 && pool->busy == 0; });
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+// Persistent worker threads, by default one less than the hardware threads since the caller works too
+// Without startWorkers everything runs on the calling thread
+void startWorkers(int count = -1);
+void stopWorkers();
+int numWorkers();
+
+// Runs job(data, index) for every index in [0, count) on the workers and the calling thread
+// and returns once all are done. Only one thread may hand out jobs at a time, and jobs may not hand out jobs.
+void runOnWorkers(int count, void (*job)(void* data, int index), void* data);
+
+// Runs function(start, end) over [0, count), split over the workers
+// Ranges shorter than minPerThread are not worth a thread of their own
+template<class Function> void parallelFor(int count, int minPerThread, bool parallel, Function function) {
+	int numThreads = parallel ? numWorkers() + 1 : 1;
+	if (numThreads > count / minPerThread) numThreads = count / minPerThread;
+	if (numThreads <= 1) {
+		function(0, count);
+		return;
+	}
+
+	struct Range {
+		Function* function;
+		int chunk;
+		int count;
+	};
+	Range range = { &function, (count + numThreads - 1) / numThreads, count };
+	runOnWorkers(numThreads, [](void* data, int index) {
+		Range* range = static_cast<Range*>(data);
+		int start = index * range->chunk;
+		int end = start + range->chunk < range->count ? start + range->chunk : range->count;
+		(*range->function)(start, end);
+	}, &range);
+}
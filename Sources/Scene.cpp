@@ -0,0 +1,501 @@
+#include "pch.h"
+#include "Scene.h"
+#include "Arrays.h"
+#include <Kore/IO/FileReader.h>
+#include <Kore/Log.h>
+#include <Kore/Math/Core.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+using namespace Kore;
+
+namespace {
+	// "KSCN" followed by the format version
+	const u32 bakedMagic = 0x4e43534b;
+	const u32 bakedVersion = 3;
+
+	const char* programNames[ProgramCount] = { "normalmap", "pacman" };
+
+	const float degreesToRadians = Kore::pi / 180.0f;
+
+	void reserveObjects(ObjectTable& objects, int capacity) {
+		if (capacity <= objects.capacity) return;
+		grow(objects.meshes, objects.count, capacity);
+		grow(objects.programs, objects.count, capacity);
+		grow(objects.diffuseTextures, objects.count, capacity);
+		grow(objects.normalMapTextures, objects.count, capacity);
+		objects.capacity = capacity;
+	}
+
+	void copyName(char* target, const char* source, int length) {
+		strncpy(target, source, length - 1);
+		target[length - 1] = 0;
+	}
+
+	int findMesh(const Scene* scene, const char* name) {
+		for (int i = 0; i < scene->numMeshes; ++i) {
+			if (strcmp(scene->meshes[i].name, name) == 0) return i;
+		}
+		return -1;
+	}
+
+	// "-" means no texture and gives -1, unknown names give -2
+	int findTexture(const Scene* scene, const char* name) {
+		if (strcmp(name, "-") == 0) return -1;
+		for (int i = 0; i < scene->numTextures; ++i) {
+			if (strcmp(scene->textures[i].name, name) == 0) return i;
+		}
+		return -2;
+	}
+
+	int findProgram(const char* name) {
+		for (int i = 0; i < ProgramCount; ++i) {
+			if (strcmp(programNames[i], name) == 0) return i;
+		}
+		return -1;
+	}
+
+	bool parseObjectLine(Scene* scene, const char* line, int lineNumber, bool lamp) {
+		char mesh[sceneNameLength], program[sceneNameLength], diffuse[sceneNameLength], normalMap[sceneNameLength];
+		float position[3] = { 0, 0, 0 };
+		float rotation[3] = { 0, 0, 0 };
+		float scale = 1.0f;
+		int parent = -1;
+		int read;
+		if (lamp) {
+			read = sscanf(line, "lamp %31s %31s %31s %31s %f", mesh, program, diffuse, normalMap, &scale);
+			if (read < 4) read = 0;
+		}
+		else {
+			read = sscanf(line, "object %31s %31s %31s %31s %f %f %f %f %f %f %f %i", mesh, program, diffuse, normalMap,
+				&position[0], &position[1], &position[2], &rotation[0], &rotation[1], &rotation[2], &scale, &parent);
+			if (read < 7) read = 0;
+		}
+		int meshIndex = read > 0 ? findMesh(scene, mesh) : -1;
+		int programIndex = read > 0 ? findProgram(program) : -1;
+		// Like in baked scenes, -1 is the only parent below 0
+		if (meshIndex < 0 || programIndex < 0 || parent < -1 || parent >= scene->objects.count) {
+			log(Warning, "Scene line %i: invalid object definition", lineNumber);
+			return false;
+		}
+		int diffuseIndex = findTexture(scene, diffuse);
+		int normalMapIndex = findTexture(scene, normalMap);
+		if (diffuseIndex < -1 || normalMapIndex < -1) {
+			log(Warning, "Scene line %i: unknown texture %s", lineNumber, diffuseIndex < -1 ? diffuse : normalMap);
+			return false;
+		}
+		int object = addObject(scene, meshIndex, programIndex, diffuseIndex, normalMapIndex,
+			position[0], position[1], position[2],
+			rotation[0] * degreesToRadians, rotation[1] * degreesToRadians, rotation[2] * degreesToRadians, scale, parent);
+		if (lamp) scene->lampObject = object;
+		return true;
+	}
+
+	void parseLine(Scene* scene, const char* line, int lineNumber) {
+		char keyword[16];
+		if (sscanf(line, "%15s", keyword) != 1 || keyword[0] == '#') return;
+
+		char name[sceneNameLength], file[sceneFileLength];
+		if (strcmp(keyword, "mesh") == 0) {
+			float scale = 1.0f;
+			if (sscanf(line, "mesh %31s %63s %f", name, file, &scale) >= 2) {
+				addMesh(scene, name, file, scale);
+				return;
+			}
+		}
+		else if (strcmp(keyword, "texture") == 0) {
+			if (sscanf(line, "texture %31s %63s", name, file) == 2) {
+				addTexture(scene, name, file);
+				return;
+			}
+		}
+		else if (strcmp(keyword, "pointlight") == 0) {
+			ScenePointLight light;
+			if (sscanf(line, "pointlight %f %f %f %f %f %f %f %f", &light.position[0], &light.position[1], &light.position[2],
+				&light.color[0], &light.color[1], &light.color[2], &light.radius, &light.power) == 8) {
+				addPointLight(scene, light.position[0], light.position[1], light.position[2],
+					light.color[0], light.color[1], light.color[2], light.radius, light.power);
+				return;
+			}
+		}
+		else if (strcmp(keyword, "light") == 0) {
+			if (sscanf(line, "light %f %f %f %f %f %f %f",
+				&scene->lightCenter[0], &scene->lightCenter[1], &scene->lightCenter[2],
+				&scene->lightOffset[0], &scene->lightOffset[1], &scene->lightOffset[2], &scene->lightRotationRate) >= 6) {
+				return;
+			}
+		}
+		else if (strcmp(keyword, "object") == 0 || strcmp(keyword, "lamp") == 0) {
+			parseObjectLine(scene, line, lineNumber, keyword[0] == 'l');
+			return;
+		}
+		log(Warning, "Scene line %i: could not parse \"%s\"", lineNumber, line);
+	}
+
+	Scene* parseText(const char* data, int length) {
+		Scene* scene = createScene();
+		char line[512];
+		int lineNumber = 1;
+		int start = 0;
+		while (start < length) {
+			int end = start;
+			while (end < length && data[end] != '\n') ++end;
+			int lineLength = end - start;
+			if (lineLength > (int)sizeof(line) - 1) lineLength = sizeof(line) - 1;
+			memcpy(line, data + start, lineLength);
+			line[lineLength] = 0;
+			if (lineLength > 0 && line[lineLength - 1] == '\r') line[lineLength - 1] = 0;
+			parseLine(scene, line, lineNumber);
+			start = end + 1;
+			++lineNumber;
+		}
+		return scene;
+	}
+
+	// Reads from the baked data, fails instead of reading past the end
+	class BakedReader {
+	public:
+		BakedReader(const char* data, int length) : data(data), length(length), offset(0) {}
+
+		bool read(void* target, int size) {
+			if (size < 0 || offset + size > length) return false;
+			memcpy(target, data + offset, size);
+			offset += size;
+			return true;
+		}
+
+	private:
+		const char* data;
+		int length;
+		int offset;
+	};
+
+	Scene* parseBaked(const char* data, int length) {
+		BakedReader reader(data, length);
+		u32 header[2];
+		s32 counts[4];
+		if (!reader.read(header, sizeof(header)) || header[1] != bakedVersion || !reader.read(counts, sizeof(counts))
+			|| counts[0] < 0 || counts[1] < 0 || counts[2] < 0 || counts[3] < 0) {
+			log(Warning, "Invalid baked scene header");
+			return nullptr;
+		}
+
+		Scene* scene = createScene();
+		bool valid = true;
+		for (int i = 0; i < counts[0] && valid; ++i) {
+			SceneMesh mesh;
+			valid = reader.read(&mesh, sizeof(mesh));
+			mesh.name[sceneNameLength - 1] = mesh.file[sceneFileLength - 1] = 0;
+			if (valid) addMesh(scene, mesh.name, mesh.file, mesh.scale);
+		}
+		for (int i = 0; i < counts[1] && valid; ++i) {
+			SceneTexture texture;
+			valid = reader.read(&texture, sizeof(texture));
+			texture.name[sceneNameLength - 1] = texture.file[sceneFileLength - 1] = 0;
+			if (valid) addTexture(scene, texture.name, texture.file);
+		}
+		for (int i = 0; i < counts[3] && valid; ++i) {
+			ScenePointLight light;
+			valid = reader.read(&light, sizeof(light));
+			if (valid) addPointLight(scene, light.position[0], light.position[1], light.position[2],
+				light.color[0], light.color[1], light.color[2], light.radius, light.power);
+		}
+		s32 lamp = -1;
+		valid = valid && reader.read(scene->lightCenter, sizeof(scene->lightCenter))
+			&& reader.read(scene->lightOffset, sizeof(scene->lightOffset))
+			&& reader.read(&scene->lightRotationRate, sizeof(scene->lightRotationRate))
+			&& reader.read(&lamp, sizeof(lamp));
+
+		// The object arrays are stored as they are in the table
+		// Every object takes at least 40 bytes, reject counts the data can't hold before allocating
+		int count = counts[2];
+		ObjectTable& objects = scene->objects;
+		Transforms* transforms = objects.transforms;
+		valid = valid && count <= length / 40;
+		if (valid) {
+			reserveObjects(objects, count);
+			resizeTransforms(transforms, count);
+		}
+		valid = valid
+			&& reader.read(transforms->positions, count * 3 * sizeof(float))
+			&& reader.read(transforms->rotations, count * 3 * sizeof(float))
+			&& reader.read(transforms->scales, count * sizeof(float))
+			&& reader.read(transforms->parents, count * sizeof(int))
+			&& reader.read(objects.meshes, count * sizeof(int))
+			&& reader.read(objects.programs, count * sizeof(int))
+			&& reader.read(objects.diffuseTextures, count * sizeof(int))
+			&& reader.read(objects.normalMapTextures, count * sizeof(int));
+		objects.count = valid ? count : 0;
+
+		for (int i = 0; i < objects.count && valid; ++i) {
+			valid = transforms->parents[i] >= -1 && transforms->parents[i] < i
+				&& objects.meshes[i] >= 0 && objects.meshes[i] < scene->numMeshes
+				&& objects.programs[i] >= 0 && objects.programs[i] < ProgramCount
+				&& objects.diffuseTextures[i] >= -1 && objects.diffuseTextures[i] < scene->numTextures
+				&& objects.normalMapTextures[i] >= -1 && objects.normalMapTextures[i] < scene->numTextures;
+		}
+		valid = valid && lamp >= -1 && lamp < objects.count;
+		if (!valid) {
+			log(Warning, "Invalid baked scene");
+			deleteScene(scene);
+			return nullptr;
+		}
+		scene->lampObject = lamp;
+		return scene;
+	}
+
+	// Empty tables may not be allocated at all
+	void writeArray(FILE* file, const void* data, size_t size, int count) {
+		if (count > 0) fwrite(data, size, count, file);
+	}
+
+	void writeTextureName(FILE* file, const Scene* scene, int texture) {
+		fprintf(file, " %s", texture >= 0 ? scene->textures[texture].name : "-");
+	}
+
+	// Small xorshift generator, so generated scenes are identical on all platforms
+	float nextRandom(unsigned& state) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return (state & 0xffffff) / (float)0x1000000;
+	}
+}
+
+Scene* createScene() {
+	Scene* scene = new Scene;
+	memset(scene, 0, sizeof(Scene));
+	scene->objects.transforms = createTransforms();
+	scene->lightOffset[1] = 1.95f;
+	scene->lightOffset[2] = 3.0f;
+	scene->lightRotationRate = 1.0f;
+	scene->lampObject = -1;
+	return scene;
+}
+
+void deleteScene(Scene* scene) {
+	delete[] scene->meshes;
+	delete[] scene->textures;
+	delete[] scene->pointLights;
+	ObjectTable& objects = scene->objects;
+	deleteTransforms(objects.transforms);
+	delete[] objects.meshes;
+	delete[] objects.programs;
+	delete[] objects.diffuseTextures;
+	delete[] objects.normalMapTextures;
+	delete scene;
+}
+
+int addMesh(Scene* scene, const char* name, const char* file, float scale) {
+	if (scene->numMeshes == scene->meshCapacity) {
+		scene->meshCapacity = scene->meshCapacity == 0 ? 8 : scene->meshCapacity * 2;
+		grow(scene->meshes, scene->numMeshes, scene->meshCapacity);
+	}
+	SceneMesh& mesh = scene->meshes[scene->numMeshes];
+	copyName(mesh.name, name, sceneNameLength);
+	copyName(mesh.file, file, sceneFileLength);
+	mesh.scale = scale;
+	return scene->numMeshes++;
+}
+
+int addTexture(Scene* scene, const char* name, const char* file) {
+	if (scene->numTextures == scene->textureCapacity) {
+		scene->textureCapacity = scene->textureCapacity == 0 ? 8 : scene->textureCapacity * 2;
+		grow(scene->textures, scene->numTextures, scene->textureCapacity);
+	}
+	SceneTexture& texture = scene->textures[scene->numTextures];
+	copyName(texture.name, name, sceneNameLength);
+	copyName(texture.file, file, sceneFileLength);
+	return scene->numTextures++;
+}
+
+int addPointLight(Scene* scene, float x, float y, float z, float r, float g, float b, float radius, float power) {
+	if (scene->numPointLights == scene->pointLightCapacity) {
+		scene->pointLightCapacity = scene->pointLightCapacity == 0 ? 8 : scene->pointLightCapacity * 2;
+		grow(scene->pointLights, scene->numPointLights, scene->pointLightCapacity);
+	}
+	ScenePointLight& light = scene->pointLights[scene->numPointLights];
+	light.position[0] = x;
+	light.position[1] = y;
+	light.position[2] = z;
+	light.color[0] = r;
+	light.color[1] = g;
+	light.color[2] = b;
+	light.radius = radius;
+	light.power = power;
+	return scene->numPointLights++;
+}
+
+int addObject(Scene* scene, int mesh, int program, int diffuse, int normalMap, float x, float y, float z, float rotX, float rotY, float rotZ, float scale, int parent) {
+	ObjectTable& objects = scene->objects;
+	if (parent < -1 || parent >= objects.count) return -1;
+	if (objects.count == objects.capacity) {
+		reserveObjects(objects, objects.capacity == 0 ? 64 : objects.capacity * 2);
+	}
+	int i = objects.count++;
+	addTransform(objects.transforms, parent, x, y, z, rotX, rotY, rotZ, scale);
+	objects.meshes[i] = mesh;
+	objects.programs[i] = program;
+	objects.diffuseTextures[i] = diffuse;
+	objects.normalMapTextures[i] = normalMap;
+	return i;
+}
+
+Scene* loadScene(const char* filename) {
+	FileReader fileReader;
+	if (!fileReader.open(filename, FileReader::Asset)) {
+		log(Warning, "Could not open scene %s", filename);
+		return nullptr;
+	}
+	int length = fileReader.size();
+	return parseScene(reinterpret_cast<char*>(fileReader.readAll()), length);
+}
+
+Scene* parseScene(const char* data, int length) {
+	u32 magic = 0;
+	if (length >= (int)sizeof(magic)) memcpy(&magic, data, sizeof(magic));
+	if (magic == bakedMagic) {
+		return parseBaked(data, length);
+	}
+	return parseText(data, length);
+}
+
+bool writeScene(const Scene* scene, const char* filename) {
+	FILE* file = fopen(filename, "w");
+	if (file == nullptr) return false;
+
+	fprintf(file, "# mesh <name> <file> <scale>\n");
+	for (int i = 0; i < scene->numMeshes; ++i) {
+		fprintf(file, "mesh %s %s %g\n", scene->meshes[i].name, scene->meshes[i].file, scene->meshes[i].scale);
+	}
+	fprintf(file, "\n# texture <name> <file>\n");
+	for (int i = 0; i < scene->numTextures; ++i) {
+		fprintf(file, "texture %s %s\n", scene->textures[i].name, scene->textures[i].file);
+	}
+	fprintf(file, "\n# light <center x y z> <offset x y z> <rotation rate>\n");
+	fprintf(file, "light %g %g %g %g %g %g %g\n", scene->lightCenter[0], scene->lightCenter[1], scene->lightCenter[2],
+		scene->lightOffset[0], scene->lightOffset[1], scene->lightOffset[2], scene->lightRotationRate);
+	if (scene->numPointLights > 0) {
+		fprintf(file, "\n# pointlight <position x y z> <color r g b> <radius> <power>\n");
+	}
+	for (int i = 0; i < scene->numPointLights; ++i) {
+		const ScenePointLight& light = scene->pointLights[i];
+		fprintf(file, "pointlight %g %g %g %g %g %g %g %g\n", light.position[0], light.position[1], light.position[2],
+			light.color[0], light.color[1], light.color[2], light.radius, light.power);
+	}
+	fprintf(file, "\n# object <mesh> <program> <diffuse> <normalMap> <position x y z> <rotation x y z in degrees> <scale> [parent object]\n");
+	fprintf(file, "# lamp <mesh> <program> <diffuse> <normalMap> <scale>\n");
+
+	const ObjectTable& objects = scene->objects;
+	const Transforms* transforms = objects.transforms;
+	for (int i = 0; i < objects.count; ++i) {
+		fprintf(file, "%s %s %s", i == scene->lampObject ? "lamp" : "object", scene->meshes[objects.meshes[i]].name, programNames[objects.programs[i]]);
+		writeTextureName(file, scene, objects.diffuseTextures[i]);
+		writeTextureName(file, scene, objects.normalMapTextures[i]);
+		if (i != scene->lampObject) {
+			const float* position = &transforms->positions[i * 3];
+			const float* rotation = &transforms->rotations[i * 3];
+			fprintf(file, " %g %g %g %g %g %g", position[0], position[1], position[2],
+				rotation[0] / degreesToRadians, rotation[1] / degreesToRadians, rotation[2] / degreesToRadians);
+		}
+		fprintf(file, " %g", transforms->scales[i]);
+		if (transforms->parents[i] >= 0) fprintf(file, " %i", transforms->parents[i]);
+		fprintf(file, "\n");
+	}
+
+	return fclose(file) == 0;
+}
+
+bool bakeScene(const Scene* scene, const char* filename) {
+	FILE* file = fopen(filename, "wb");
+	if (file == nullptr) return false;
+
+	const ObjectTable& objects = scene->objects;
+	u32 header[2] = { bakedMagic, bakedVersion };
+	s32 counts[4] = { scene->numMeshes, scene->numTextures, objects.count, scene->numPointLights };
+	s32 lamp = scene->lampObject;
+	int count = objects.count;
+
+	writeArray(file, header, sizeof(header), 1);
+	writeArray(file, counts, sizeof(counts), 1);
+	writeArray(file, scene->meshes, sizeof(SceneMesh), scene->numMeshes);
+	writeArray(file, scene->textures, sizeof(SceneTexture), scene->numTextures);
+	writeArray(file, scene->pointLights, sizeof(ScenePointLight), scene->numPointLights);
+	writeArray(file, scene->lightCenter, sizeof(scene->lightCenter), 1);
+	writeArray(file, scene->lightOffset, sizeof(scene->lightOffset), 1);
+	writeArray(file, &scene->lightRotationRate, sizeof(scene->lightRotationRate), 1);
+	writeArray(file, &lamp, sizeof(lamp), 1);
+	writeArray(file, objects.transforms->positions, sizeof(float), count * 3);
+	writeArray(file, objects.transforms->rotations, sizeof(float), count * 3);
+	writeArray(file, objects.transforms->scales, sizeof(float), count);
+	writeArray(file, objects.transforms->parents, sizeof(int), count);
+	writeArray(file, objects.meshes, sizeof(int), count);
+	writeArray(file, objects.programs, sizeof(int), count);
+	writeArray(file, objects.diffuseTextures, sizeof(int), count);
+	writeArray(file, objects.normalMapTextures, sizeof(int), count);
+
+	bool success = ferror(file) == 0;
+	return fclose(file) == 0 && success;
+}
+
+Scene* generateScene(int numObjects, unsigned seed) {
+	Scene* scene = createScene();
+	int box = addMesh(scene, "box", "box.obj");
+	int ball = addMesh(scene, "ball", "ball.obj");
+	int lampMesh = addMesh(scene, "lamp", "ball.obj", 0.3f);
+	int pacMan = addMesh(scene, "pacman", "PacMan.obj");
+
+	const int numMaterials = 3;
+	int diffuse[numMaterials], normalMap[numMaterials];
+	diffuse[0] = addTexture(scene, "t171", "171.JPG");
+	normalMap[0] = addTexture(scene, "t171_norm", "171_norm.JPG");
+	diffuse[1] = addTexture(scene, "t176", "176.JPG");
+	normalMap[1] = addTexture(scene, "t176_norm", "176_norm.JPG");
+	diffuse[2] = addTexture(scene, "t199", "199.JPG");
+	normalMap[2] = addTexture(scene, "t199_norm", "199_norm.JPG");
+	int lightTexture = addTexture(scene, "light", "light_tex.png");
+
+	reserveObjects(scene->objects, numObjects + 1);
+	scene->lampObject = addObject(scene, lampMesh, ProgramNormalMap, lightTexture, lightTexture, 0, 0, 0);
+
+	// Objects are placed on a cube shaped grid around the origin, each cell is jittered a bit
+	const float spacing = 3.0f;
+	int side = (int)ceil(cbrt((double)numObjects));
+	float offset = (side - 1) * spacing * 0.5f;
+	unsigned state = seed == 0 ? 1 : seed;
+
+	// One light for every 20 objects, up to the 1000 the clustered shading handles at once
+	int numLights = numObjects / 20 < 1000 ? numObjects / 20 : 1000;
+	float extent = side * spacing;
+	for (int i = 0; i < numLights; ++i) {
+		float x = (nextRandom(state) - 0.5f) * extent;
+		float y = (nextRandom(state) - 0.5f) * extent;
+		float z = (nextRandom(state) - 0.5f) * extent;
+		addPointLight(scene, x, y, z, 0.3f + 0.7f * nextRandom(state), 0.3f + 0.7f * nextRandom(state), 0.3f + 0.7f * nextRandom(state),
+			3.0f + 5.0f * nextRandom(state), 2.0f + 3.0f * nextRandom(state));
+	}
+	for (int i = 0; i < numObjects; ++i) {
+		float x = (i % side) * spacing - offset + (nextRandom(state) - 0.5f);
+		float y = ((i / side) % side) * spacing - offset + (nextRandom(state) - 0.5f);
+		float z = (i / (side * side)) * spacing - offset + (nextRandom(state) - 0.5f);
+		float rotX = nextRandom(state) * 2.0f * Kore::pi;
+		float rotY = nextRandom(state) * 2.0f * Kore::pi;
+		float rotZ = nextRandom(state) * 2.0f * Kore::pi;
+		float scale = 0.5f + nextRandom(state);
+		float kind = nextRandom(state);
+		if (kind < 0.1f && scene->objects.count > 1) {
+			// Small ball attached to the previous object, builds up hierarchies of varying depth
+			int parent = scene->objects.count - 1;
+			addObject(scene, ball, ProgramNormalMap, diffuse[0], normalMap[0], 1.5f, 0, 0, rotX, rotY, rotZ, 0.3f, parent);
+		}
+		else if (kind < 0.3f) {
+			addObject(scene, pacMan, ProgramPacMan, -1, -1, x, y, z, 0, rotY, Kore::pi, scale);
+		}
+		else {
+			int material = (int)(nextRandom(state) * numMaterials) % numMaterials;
+			addObject(scene, kind < 0.6f ? box : ball, ProgramNormalMap, diffuse[material], normalMap[material], x, y, z, rotX, rotY, rotZ, scale);
+		}
+	}
+	return scene;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "Transforms.h"
+
+// Shader programs an object can be rendered with
+enum ProgramId {
+	ProgramNormalMap = 0,
+	ProgramPacMan = 1,
+	ProgramCount
+};
+
+const int sceneNameLength = 32;
+const int sceneFileLength = 64;
+
+// A mesh file, the scale is baked into the vertex buffer
+struct SceneMesh {
+	char name[sceneNameLength];
+	char file[sceneFileLength];
+	float scale;
+};
+
+struct SceneTexture {
+	char name[sceneNameLength];
+	char file[sceneFileLength];
+};
+
+struct ScenePointLight {
+	float position[3];
+	float color[3];
+	float radius;
+	float power;
+};
+
+// Struct-of-arrays table of all objects in the scene
+// Grows dynamically, entry i of every array belongs to object i
+struct ObjectTable {
+	int count;
+	int capacity;
+
+	// Position, rotation, scale and parent of every object, owned by the table. Transform i belongs to object i.
+	// Rotations are euler angles in radians, parents always come before their children.
+	Transforms* transforms;
+
+	// Indices into the mesh and texture tables, -1 for no texture
+	int* meshes;
+	int* programs;
+	int* diffuseTextures;
+	int* normalMapTextures;
+};
+
+struct Scene {
+	SceneMesh* meshes;
+	int numMeshes;
+	int meshCapacity;
+
+	SceneTexture* textures;
+	int numTextures;
+	int textureCapacity;
+
+	// Static lights, in addition to the orbiting light
+	ScenePointLight* pointLights;
+	int numPointLights;
+	int pointLightCapacity;
+
+	ObjectTable objects;
+
+	// The light orbits around lightCenter, starting at lightCenter + lightOffset
+	float lightCenter[3];
+	float lightOffset[3];
+	float lightRotationRate;
+
+	// Object following the light, -1 if there is none
+	int lampObject;
+};
+
+Scene* createScene();
+void deleteScene(Scene* scene);
+
+int addMesh(Scene* scene, const char* name, const char* file, float scale = 1.0f);
+int addTexture(Scene* scene, const char* name, const char* file);
+int addPointLight(Scene* scene, float x, float y, float z, float r, float g, float b, float radius, float power);
+// Returns -1 if parent is neither -1 nor an existing object
+int addObject(Scene* scene, int mesh, int program, int diffuse, int normalMap,
+	float x, float y, float z, float rotX = 0.0f, float rotY = 0.0f, float rotZ = 0.0f, float scale = 1.0f, int parent = -1);
+
+// Loads a scene in either the text or the baked binary form
+Scene* loadScene(const char* filename);
+Scene* parseScene(const char* data, int length);
+
+// Writes the scene in the text form or the baked binary form
+bool writeScene(const Scene* scene, const char* filename);
+bool bakeScene(const Scene* scene, const char* filename);
+
+// Synthetic scene with numObjects objects on a jittered grid, for benchmarking
+Scene* generateScene(int numObjects, unsigned seed = 1);
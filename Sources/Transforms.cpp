@@ -0,0 +1,227 @@
+#include "pch.h"
+#include "Transforms.h"
+#include "Arrays.h"
+#include "Parallel.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define TRANSFORMS_SSE
+#include <xmmintrin.h>
+#endif
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+namespace {
+	// Below this many transforms per thread, spawning threads costs more than it saves
+	const int minTransformsPerThread = 4096;
+
+	const int matrixAlignment = 32;
+
+	// The pointer handed out is aligned, the original allocation is stored right before it
+	float* allocateMatrices(int count) {
+		char* memory = new char[count * 16 * sizeof(float) + matrixAlignment + sizeof(char*)];
+		uintptr_t aligned = ((uintptr_t)(memory + sizeof(char*)) + matrixAlignment - 1) & ~(uintptr_t)(matrixAlignment - 1);
+		reinterpret_cast<char**>(aligned)[-1] = memory;
+		return reinterpret_cast<float*>(aligned);
+	}
+
+	void freeMatrices(float* matrices) {
+		if (matrices == nullptr) return;
+		delete[] reinterpret_cast<char**>(matrices)[-1];
+	}
+
+	void growMatrices(float*& matrices, int count, int capacity) {
+		float* bigger = allocateMatrices(capacity);
+		if (count > 0) memcpy(bigger, matrices, count * 16 * sizeof(float));
+		freeMatrices(matrices);
+		matrices = bigger;
+	}
+
+	void reserve(Transforms* transforms, int capacity) {
+		if (capacity <= transforms->capacity) return;
+		int count = transforms->count;
+		grow(transforms->positions, count * 3, capacity * 3);
+		grow(transforms->rotations, count * 3, capacity * 3);
+		grow(transforms->scales, count, capacity);
+		grow(transforms->parents, count, capacity);
+		grow(transforms->dirty, count, capacity);
+		growMatrices(transforms->world, count, capacity);
+		growMatrices(transforms->mvp, count, capacity);
+		transforms->capacity = capacity;
+	}
+
+	// Translation * RotationZ * RotationY * RotationX * Scale
+	void localMatrix(const Transforms* transforms, int i, float* out) {
+		const float* position = &transforms->positions[i * 3];
+		const float* rotation = &transforms->rotations[i * 3];
+		float scale = transforms->scales[i];
+		float sx = sinf(rotation[0]), cx = cosf(rotation[0]);
+		float sy = sinf(rotation[1]), cy = cosf(rotation[1]);
+		float sz = sinf(rotation[2]), cz = cosf(rotation[2]);
+
+		out[0] = cz * cy * scale;
+		out[1] = sz * cy * scale;
+		out[2] = -sy * scale;
+		out[3] = 0.0f;
+
+		out[4] = (cz * sy * sx - sz * cx) * scale;
+		out[5] = (sz * sy * sx + cz * cx) * scale;
+		out[6] = cy * sx * scale;
+		out[7] = 0.0f;
+
+		out[8] = (cz * sy * cx + sz * sx) * scale;
+		out[9] = (sz * sy * cx - cz * sx) * scale;
+		out[10] = cy * cx * scale;
+		out[11] = 0.0f;
+
+		out[12] = position[0];
+		out[13] = position[1];
+		out[14] = position[2];
+		out[15] = 1.0f;
+	}
+}
+
+void multiplyMatrices(const float* a, const float* b, float* out) {
+#if defined(__AVX__)
+	// Two result columns per iteration
+	__m256 a0 = _mm256_broadcast_ps((const __m128*)&a[0]);
+	__m256 a1 = _mm256_broadcast_ps((const __m128*)&a[4]);
+	__m256 a2 = _mm256_broadcast_ps((const __m128*)&a[8]);
+	__m256 a3 = _mm256_broadcast_ps((const __m128*)&a[12]);
+	for (int column = 0; column < 4; column += 2) {
+		const float* b0 = &b[column * 4];
+		const float* b1 = &b[column * 4 + 4];
+		__m256 result = _mm256_mul_ps(a0, _mm256_setr_ps(b0[0], b0[0], b0[0], b0[0], b1[0], b1[0], b1[0], b1[0]));
+		result = _mm256_add_ps(result, _mm256_mul_ps(a1, _mm256_setr_ps(b0[1], b0[1], b0[1], b0[1], b1[1], b1[1], b1[1], b1[1])));
+		result = _mm256_add_ps(result, _mm256_mul_ps(a2, _mm256_setr_ps(b0[2], b0[2], b0[2], b0[2], b1[2], b1[2], b1[2], b1[2])));
+		result = _mm256_add_ps(result, _mm256_mul_ps(a3, _mm256_setr_ps(b0[3], b0[3], b0[3], b0[3], b1[3], b1[3], b1[3], b1[3])));
+		_mm256_storeu_ps(&out[column * 4], result);
+	}
+#elif defined(TRANSFORMS_SSE)
+	__m128 a0 = _mm_loadu_ps(&a[0]);
+	__m128 a1 = _mm_loadu_ps(&a[4]);
+	__m128 a2 = _mm_loadu_ps(&a[8]);
+	__m128 a3 = _mm_loadu_ps(&a[12]);
+	for (int column = 0; column < 4; ++column) {
+		const float* bColumn = &b[column * 4];
+		__m128 result = _mm_mul_ps(a0, _mm_set1_ps(bColumn[0]));
+		result = _mm_add_ps(result, _mm_mul_ps(a1, _mm_set1_ps(bColumn[1])));
+		result = _mm_add_ps(result, _mm_mul_ps(a2, _mm_set1_ps(bColumn[2])));
+		result = _mm_add_ps(result, _mm_mul_ps(a3, _mm_set1_ps(bColumn[3])));
+		_mm_storeu_ps(&out[column * 4], result);
+	}
+#else
+	for (int column = 0; column < 4; ++column) {
+		for (int row = 0; row < 4; ++row) {
+			out[column * 4 + row] = a[row] * b[column * 4] + a[4 + row] * b[column * 4 + 1]
+				+ a[8 + row] * b[column * 4 + 2] + a[12 + row] * b[column * 4 + 3];
+		}
+	}
+#endif
+}
+
+Transforms* createTransforms(int capacity) {
+	Transforms* transforms = new Transforms;
+	memset(transforms, 0, sizeof(Transforms));
+	reserve(transforms, capacity > 0 ? capacity : 1);
+	return transforms;
+}
+
+void deleteTransforms(Transforms* transforms) {
+	delete[] transforms->positions;
+	delete[] transforms->rotations;
+	delete[] transforms->scales;
+	delete[] transforms->parents;
+	delete[] transforms->dirty;
+	freeMatrices(transforms->world);
+	freeMatrices(transforms->mvp);
+	delete transforms;
+}
+
+int addTransform(Transforms* transforms, int parent, float x, float y, float z, float rotX, float rotY, float rotZ, float scale) {
+	if (parent >= transforms->count) return -1;
+	if (transforms->count == transforms->capacity) {
+		reserve(transforms, transforms->capacity * 2);
+	}
+	int i = transforms->count++;
+	transforms->parents[i] = parent < 0 ? -1 : parent;
+	setPosition(transforms, i, x, y, z);
+	setRotation(transforms, i, rotX, rotY, rotZ);
+	setScale(transforms, i, scale);
+	return i;
+}
+
+void resizeTransforms(Transforms* transforms, int count) {
+	reserve(transforms, count);
+	for (int i = transforms->count; i < count; ++i) {
+		transforms->dirty[i] = true;
+	}
+	transforms->count = count;
+}
+
+void setPosition(Transforms* transforms, int index, float x, float y, float z) {
+	float* position = &transforms->positions[index * 3];
+	position[0] = x;
+	position[1] = y;
+	position[2] = z;
+	transforms->dirty[index] = true;
+}
+
+void setRotation(Transforms* transforms, int index, float x, float y, float z) {
+	float* rotation = &transforms->rotations[index * 3];
+	rotation[0] = x;
+	rotation[1] = y;
+	rotation[2] = z;
+	transforms->dirty[index] = true;
+}
+
+void setScale(Transforms* transforms, int index, float scale) {
+	transforms->scales[index] = scale;
+	transforms->dirty[index] = true;
+}
+
+void updateTransforms(Transforms* transforms, const float* viewProjection, bool parallel) {
+	int count = transforms->count;
+	bool* dirty = transforms->dirty;
+	const int* parents = transforms->parents;
+	float* world = transforms->world;
+	float* mvp = transforms->mvp;
+
+	// Children of changed transforms change too, parents come first so one pass suffices
+	bool anyChildDirty = false;
+	for (int i = 0; i < count; ++i) {
+		if (parents[i] >= 0 && dirty[parents[i]]) dirty[i] = true;
+		anyChildDirty = anyChildDirty || (dirty[i] && parents[i] >= 0);
+	}
+
+	// Local matrices are independent of each other
+	parallelFor(count, minTransformsPerThread, parallel, [=](int start, int end) {
+		for (int i = start; i < end; ++i) {
+			if (dirty[i]) localMatrix(transforms, i, &world[i * 16]);
+		}
+	});
+
+	// Applying the parents has to follow the hierarchy
+	if (anyChildDirty) {
+		float local[16];
+		for (int i = 0; i < count; ++i) {
+			if (!dirty[i] || parents[i] < 0) continue;
+			memcpy(local, &world[i * 16], sizeof(local));
+			multiplyMatrices(&world[parents[i] * 16], local, &world[i * 16]);
+		}
+	}
+
+	bool allChanged = memcmp(transforms->viewProjection, viewProjection, sizeof(transforms->viewProjection)) != 0;
+	memcpy(transforms->viewProjection, viewProjection, sizeof(transforms->viewProjection));
+	const float* vp = transforms->viewProjection;
+	parallelFor(count, minTransformsPerThread, parallel, [=](int start, int end) {
+		for (int i = start; i < end; ++i) {
+			if (allChanged || dirty[i]) multiplyMatrices(vp, &world[i * 16], &mvp[i * 16]);
+			dirty[i] = false;
+		}
+	});
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+// Struct-of-arrays transform hierarchy
+// Matrices are stored column major with 16 floats each, like Kore::mat4
+struct Transforms {
+	int count;
+	int capacity;
+
+	// Local transform: 3 floats each for position and rotation (euler angles in radians), one for the uniform scale
+	float* positions;
+	float* rotations;
+	float* scales;
+
+	// Index of the parent transform, -1 for roots. Parents always come before their children.
+	int* parents;
+
+	// Set when the local transform changed since the last update
+	bool* dirty;
+
+	// Results of updateTransforms, 32 byte aligned
+	float* world;
+	float* mvp;
+
+	// View projection matrix the MVP matrices were computed with
+	float viewProjection[16];
+};
+
+Transforms* createTransforms(int capacity = 64);
+void deleteTransforms(Transforms* transforms);
+
+// Returns -1 if parent is not an existing transform
+int addTransform(Transforms* transforms, int parent, float x, float y, float z,
+	float rotX = 0.0f, float rotY = 0.0f, float rotZ = 0.0f, float scale = 1.0f);
+
+// Sets the number of transforms, for filling the arrays directly. Added transforms are uninitialized and dirty.
+void resizeTransforms(Transforms* transforms, int count);
+
+void setPosition(Transforms* transforms, int index, float x, float y, float z);
+void setRotation(Transforms* transforms, int index, float x, float y, float z);
+void setScale(Transforms* transforms, int index, float scale);
+
+// Recomputes the world matrices of dirty transforms and their descendants and the MVP matrices of all of them.
+// If the view projection matrix changed, all MVP matrices are recomputed.
+// Large batches are split over worker threads unless parallel is false.
+void updateTransforms(Transforms* transforms, const float* viewProjection, bool parallel = true);
+
+// out = a * b for column major 4x4 matrices, out may not alias a or b
+void multiplyMatrices(const float* a, const float* b, float* out);
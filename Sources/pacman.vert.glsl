@@ -5,19 +5,21 @@ in vec2 tex;
 in vec3 nor;
 in vec3 bitangent;
 in vec3 tangent;
-uniform mat4 V;
-uniform mat4 P;
-uniform mat4 M;
+// Model view projection matrix, precomputed on the CPU
+uniform mat4 MVP;
 
 //The time of the frame
 uniform float time;
 
-// Add animation parameters you need here
-// See the comments in the SceneParameters and ShaderProgram structs/classes for how to add them on the CPU side
+// Per instance animation parameters, see AnimationClip
+uniform float phase;
 uniform float duration;
 uniform float closeAngle;
 uniform float openAngle;
 
+// 0 if the vertices were already deformed on the CPU
+uniform float animate;
+
 #define M_PI 3.1415926535897932384626433832795
 
 void main() {
@@ -26,6 +28,11 @@ void main() {
 	vec3 dontremoveme = nor; vec2 meneither = tex; dontremoveme = bitangent; dontremoveme = tangent;
 
 
+	if (animate < 0.5) {
+		gl_Position = MVP * vec4(pos, 1.0);
+		return;
+	}
+
 	/************************************************************************/
 	/* Exercise P6.2: Implement the characteristic PacMan eating animation   /
 	 * here. See the video on the website for reference.                     /
@@ -37,7 +44,7 @@ void main() {
 
     // Calculate the new angle, depending on the animation parameters and the time
     float angleDiff = closeAngle - openAngle;
-    float morph = ( ((sin(time*(2.0*M_PI)/duration) + 1.0)/2.0) * ( angleDiff/openAngle )) + 1.0;
+    float morph = ( ((sin((time + phase)*(2.0*M_PI)/duration) + 1.0)/2.0) * ( angleDiff/openAngle )) + 1.0;
     a = a * morph;
 
     // Calculate angles over 180 degrees
@@ -46,5 +53,5 @@ void main() {
     float c = a + (s*0.5 + 0.5) * 2.0 * (b);
 
     // And set the position of the vertex
-	gl_Position = P * V * M * vec4(cos(c)*l, -sin(c)*l, pos.z, 1.0);
+	gl_Position = MVP * vec4(cos(c)*l, -sin(c)*l, pos.z, 1.0);
 }
@@ -4,8 +4,22 @@
 uniform sampler2D tex;
 uniform sampler2D normalMap;
 
-// Light and camera in world space
-uniform vec3 light;
+// Clustered lights, see Clusters.h
+// lightData: position and radius in the first row, color and power in the second, falloff in the third, one column per light
+// clusterData: offset and count into lightIndices, one row per depth slice
+// lightIndices: four light indices per texel
+uniform sampler2D lightData;
+uniform sampler2D clusterData;
+uniform sampler2D lightIndices;
+
+// Tiles in x and y, depth slices and width of lightData
+uniform vec4 clusterGrid;
+// Near plane, slices per unit of log depth, screen width and height
+uniform vec4 clusterDepth;
+// Size of lightIndices
+uniform vec2 lightIndicesSize;
+
+// Camera in world space
 uniform vec3 eye;
 
 // Position in world space
@@ -13,20 +27,21 @@ in vec3 position;
 // Texture coordinate
 in vec2 texCoord;
 
-// Light and camera position in tangent space
-in vec3 light_tangentspace;
-in vec3 eye_tangentspace;
+// Tangent space basis in world space
+in vec3 tangent_worldspace;
+in vec3 bitangent_worldspace;
+in vec3 normal_worldspace;
 
-// Distance between the light and the current point. For the DirectX backend, we need to compute this in the vertex shader, if not, it will get a wrong value
-in float lightDistance;
+in float viewDepth;
 
 out vec4 frag;
 
-void main() {
+// Reads texel (x, y) of a data texture
+vec4 fetch(sampler2D data, float x, float y, vec2 size) {
+	return texture(data, vec2((x + 0.5) / size.x, (y + 0.5) / size.y));
+}
 
-	// Color and intensity of the light
-	vec3 LightColor = vec3(1,1,1);
-	float LightPower = 5.0;
+void main() {
 	
 	// Material properties
 	vec3 MaterialDiffuseColor = texture( tex, texCoord).rgb;
@@ -40,42 +55,71 @@ void main() {
 	 * For good measure, you can normalize them again                        /
 	/************************************************************************/
 	vec3 TextureNormal_tangentspace = normalize(texture( normalMap, texCoord ).rgb * 2.0 - 1.0);
-	
-	// Distance to the light
-	// float lightDistance = length( light - position );
-
-	// Normal of the computed fragment, in camera space
-	vec3 n = TextureNormal_tangentspace;
-	// Direction of the light (from the fragment to the light)
-	vec3 l = normalize(light_tangentspace);
-	// Cosine of the angle between the normal and the light direction, 
-	// clamped above 0
-	//  - light is at the vertical of the triangle -> 1
-	//  - light is perpendicular to the triangle -> 0
-	//  - light is behind the triangle -> 0
-	float cosTheta = clamp( dot( n,l ), 0.0, 1.0 );
+
+	// Normal of the computed fragment, in world space
+	mat3 TBN = mat3(normalize(tangent_worldspace), normalize(bitangent_worldspace), normalize(normal_worldspace));
+	vec3 n = normalize(TBN * TextureNormal_tangentspace);
 
 	// Eye vector (towards the camera)
-	vec3 E = normalize(eye_tangentspace);
-	// Direction in which the triangle reflects the light
-	vec3 R = reflect(-l,n);
-	// Cosine of the angle between the Eye vector and the Reflect vector,
-	// clamped to 0
-	//  - Looking into the reflection -> 1
-	//  - Looking elsewhere -> < 1
-	float cosAlpha = clamp( dot( E,R ), 0.0, 1.0 );
-
-	float radius = 5.0;
-	float a = 2.0 / radius;
-	float b = 1.0 / (radius * radius);
-	float attenuation = 1.0 / (1.0 + a*lightDistance + b*lightDistance*lightDistance);
+	vec3 E = normalize(eye - position);
+
+	// Find the cluster of this fragment
+	float tileX = min(floor(gl_FragCoord.x / clusterDepth.z * clusterGrid.x), clusterGrid.x - 1.0);
+	float tileY = min(floor(gl_FragCoord.y / clusterDepth.w * clusterGrid.y), clusterGrid.y - 1.0);
+	float slice = clamp(floor(log(max(viewDepth, clusterDepth.x) / clusterDepth.x) * clusterDepth.y), 0.0, clusterGrid.z - 1.0);
+	vec4 cluster = fetch(clusterData, tileX + tileY * clusterGrid.x, slice, vec2(clusterGrid.x * clusterGrid.y, clusterGrid.z));
 
 	vec3 color = 
 		// Ambient : simulates indirect lighting
-		MaterialAmbientColor +
-		// Diffuse : "color" of the object
-		MaterialDiffuseColor * LightColor * LightPower * cosTheta * attenuation + 
-		// Specular : reflective highlight, like a mirror
-		MaterialSpecularColor * LightColor * LightPower * pow(cosAlpha,5.0) * attenuation;
+		MaterialAmbientColor;
+
+	int numLights = int(cluster.y + 0.5);
+	for (int i = 0; i < numLights; ++i) {
+		float index = cluster.x + float(i);
+		float texel = floor(index / 4.0);
+		vec4 indices = fetch(lightIndices, mod(texel, lightIndicesSize.x), floor(texel / lightIndicesSize.x), lightIndicesSize);
+		float component = index - texel * 4.0;
+		float light = component < 0.5 ? indices.x : (component < 1.5 ? indices.y : (component < 2.5 ? indices.z : indices.w));
+
+		vec4 positionRadius = fetch(lightData, light, 0.0, vec2(clusterGrid.w, 3.0));
+		vec4 colorPower = fetch(lightData, light, 1.0, vec2(clusterGrid.w, 3.0));
+		float falloff = fetch(lightData, light, 2.0, vec2(clusterGrid.w, 3.0)).x;
+		vec3 LightColor = colorPower.rgb;
+		float LightPower = colorPower.a;
+
+		// Direction of the light (from the fragment to the light) and distance to the light
+		vec3 l = positionRadius.xyz - position;
+		float lightDistance = length(l);
+		l = l / lightDistance;
+
+		// Cosine of the angle between the normal and the light direction, 
+		// clamped above 0
+		//  - light is at the vertical of the triangle -> 1
+		//  - light is perpendicular to the triangle -> 0
+		//  - light is behind the triangle -> 0
+		float cosTheta = clamp( dot( n,l ), 0.0, 1.0 );
+
+		// Direction in which the triangle reflects the light
+		vec3 R = reflect(-l,n);
+		// Cosine of the angle between the Eye vector and the Reflect vector,
+		// clamped to 0
+		//  - Looking into the reflection -> 1
+		//  - Looking elsewhere -> < 1
+		float cosAlpha = clamp( dot( E,R ), 0.0, 1.0 );
+
+		float a = 2.0 / falloff;
+		float b = 1.0 / (falloff * falloff);
+		float attenuation = 1.0 / (1.0 + a*lightDistance + b*lightDistance*lightDistance);
+
+		// Fade out to exactly 0 at the radius the light is culled at, so there is no seam at cluster boundaries
+		float window = clamp(1.0 - pow(lightDistance / positionRadius.w, 4.0), 0.0, 1.0);
+		attenuation *= window * window;
+
+		color +=
+			// Diffuse : "color" of the object
+			MaterialDiffuseColor * LightColor * LightPower * cosTheta * attenuation + 
+			// Specular : reflective highlight, like a mirror
+			MaterialSpecularColor * LightColor * LightPower * pow(cosAlpha,5.0) * attenuation;
+	}
 	frag = vec4(color, 1.0);
 }